@@ -0,0 +1,195 @@
+/*
+ * Copyright 2010 Johan Veenhuizen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Benchmark of desktop switching with many clients.
+ *
+ * Run it as a client of a display managed by wind. It spreads
+ * the given number of small windows over the desktops, waits
+ * until wind manages them all, and then switches desktops through
+ * _NET_CURRENT_DESKTOP requests. A switch is timed from sending
+ * the request until wind publishes the new current desktop, which
+ * it does after it has mapped and unmapped the windows.
+ *
+ * With -p, SIGUSR1 is sent to the given wind process at the end,
+ * so that it prints its statistics if it was started with -v.
+ *
+ * Usage: deskbench [-n clients] [-d desktops] [-s switches] [-p pid]
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+
+#include "../wind.h"
+
+static Atom NET_CLIENT_LIST;
+static Atom NET_CURRENT_DESKTOP;
+static Atom NET_NUMBER_OF_DESKTOPS;
+static Atom NET_WM_DESKTOP;
+
+static const struct atomdef atoms[] = {
+	{ &NET_CLIENT_LIST, "_NET_CLIENT_LIST" },
+	{ &NET_CURRENT_DESKTOP, "_NET_CURRENT_DESKTOP" },
+	{ &NET_NUMBER_OF_DESKTOPS, "_NET_NUMBER_OF_DESKTOPS" },
+	{ &NET_WM_DESKTOP, "_NET_WM_DESKTOP" },
+};
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-n clients] [-d desktops] "
+			"[-s switches] [-p pid]\n", progname);
+	exit(1);
+}
+
+static void sendrootmessage(Atom type, long data)
+{
+	XSendEvent(dpy, root, False,
+			SubstructureNotifyMask | SubstructureRedirectMask,
+			(XEvent *)&(XClientMessageEvent){
+				.type = ClientMessage,
+				.window = root,
+				.message_type = type,
+				.format = 32,
+				.data.l[0] = data,
+				.data.l[1] = CurrentTime });
+}
+
+static unsigned long countclients(void)
+{
+	unsigned long n = 0;
+	void *v = getprop(root, NET_CLIENT_LIST, XA_WINDOW, 32, &n);
+	if (v != NULL)
+		XFree(v);
+	return n;
+}
+
+static void waitproperty(Atom atom)
+{
+	for (;;) {
+		XEvent e;
+		XNextEvent(dpy, &e);
+		if (e.type == PropertyNotify && e.xproperty.atom == atom)
+			return;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int nclients = 1000;
+	int ndesks = 12;
+	int nswitches = 100;
+	pid_t pid = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:s:p:")) != -1)
+		switch (opt) {
+		case 'n':
+			nclients = atoi(optarg);
+			break;
+		case 'd':
+			ndesks = atoi(optarg);
+			break;
+		case 's':
+			nswitches = atoi(optarg);
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	if (nclients < 1 || ndesks < 2 || nswitches < 1)
+		usage(argv[0]);
+
+	if ((dpy = XOpenDisplay(NULL)) == NULL) {
+		errorf("cannot open display \"%s\"", XDisplayName(NULL));
+		return 1;
+	}
+	scr = DefaultScreen(dpy);
+	root = DefaultRootWindow(dpy);
+	declareatoms(atoms, NELEM(atoms));
+	internatoms();
+	XSelectInput(dpy, root, PropertyChangeMask);
+
+	sendrootmessage(NET_NUMBER_OF_DESKTOPS, ndesks);
+	XSync(dpy, False);
+
+	unsigned long before = countclients();
+	Window *windows = xmalloc(nclients * sizeof windows[0]);
+	unsigned long t = usecs();
+	for (int i = 0; i < nclients; i++) {
+		windows[i] = XCreateSimpleWindow(dpy, root,
+				(i * 7) % 640, (i * 5) % 480, 64, 48, 0,
+				BlackPixel(dpy, scr), WhitePixel(dpy, scr));
+		long desk = i % ndesks;
+		setprop(windows[i], NET_WM_DESKTOP, XA_CARDINAL, 32,
+				&desk, 1);
+		XMapWindow(dpy, windows[i]);
+	}
+	while (countclients() < before + nclients) {
+		XSync(dpy, True);
+		usleep(10000);
+	}
+	t = usecs() - t;
+	printf("%d clients on %d desktops managed in %lu us\n",
+			nclients, ndesks, t);
+
+	unsigned long n = 0;
+	unsigned long *curp = getprop(root, NET_CURRENT_DESKTOP,
+			XA_CARDINAL, 32, &n);
+	unsigned long cur = curp != NULL && n == 1 ? *curp : 0;
+	if (curp != NULL)
+		XFree(curp);
+
+	XSync(dpy, True);
+	unsigned long total = 0;
+	unsigned long min = (unsigned long)-1;
+	unsigned long max = 0;
+	for (int i = 0; i < nswitches; i++) {
+		cur = (cur + 1) % ndesks;
+		t = usecs();
+		sendrootmessage(NET_CURRENT_DESKTOP, cur);
+		XFlush(dpy);
+		waitproperty(NET_CURRENT_DESKTOP);
+		t = usecs() - t;
+		total += t;
+		min = MIN(min, t);
+		max = MAX(max, t);
+	}
+	printf("%d desktop switches: %lu us mean, %lu min, %lu max\n",
+			nswitches, total / nswitches, min, max);
+
+	for (int i = 0; i < nclients; i++)
+		XDestroyWindow(dpy, windows[i]);
+	XSync(dpy, False);
+	free(windows);
+
+	if (pid != 0)
+		kill(pid, SIGUSR1);
+
+	XCloseDisplay(dpy);
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2010 Johan Veenhuizen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the listener lookup done for every event.
+ *
+ * It compares XFindContext, which wind used before, with a bare
+ * lookup in the window hash table, and with getlistener from lib.c,
+ * which adds the one-entry cache of the last window and is what
+ * redirect uses. Lookups follow a synthetic event stream
+ * in which each window gets a run of consecutive events, as
+ * happens while a frame is dragged.
+ *
+ * The context manager keeps its table in the Display. If no X
+ * server can be reached, a blank Display is used that only holds
+ * the table. It has no locks, while a connection has them if Xlib
+ * was initialized for threads, so XFindContext is then measured
+ * without the locking it otherwise does.
+ *
+ * Usage: listenbench [windows [run length [lookups]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <X11/Xlibint.h>
+#include <X11/Xresource.h>
+#include <X11/Xutil.h>
+
+#include "../wind.h"
+
+static struct hashtab table;
+static XContext context;
+static Display *contextdpy;
+
+static void *findlistener(Window w)
+{
+	return getlistener(w);
+}
+
+static void *findcontext(Window w)
+{
+	XPointer p;
+	if (XFindContext(contextdpy, w, context, &p) == 0)
+		return p;
+	return NULL;
+}
+
+static void *findtable(Window w)
+{
+	return htfind(&table, w);
+}
+
+static void run(const char *name, void *(*find)(Window),
+		const Window *events, unsigned long n)
+{
+	unsigned long misses = 0;
+	unsigned long t = usecs();
+	for (unsigned long i = 0; i < n; i++)
+		if (find(events[i]) == NULL)
+			misses++;
+	t = usecs() - t;
+	if (misses > 0)
+		printf("%s: %lu lookups failed\n", name, misses);
+	printf("%-16s %8lu us %8.2f ns/lookup\n", name, t,
+			1000.0 * t / n);
+}
+
+int main(int argc, char *argv[])
+{
+	int nwindows = argc > 1 ? atoi(argv[1]) : 2000;
+	int runlength = argc > 2 ? atoi(argv[2]) : 8;
+	unsigned long nevents = argc > 3 ? strtoul(argv[3], NULL, 10) :
+			10000000;
+	if (nwindows < 1 || runlength < 1 || nevents < 1) {
+		fprintf(stderr, "usage: %s [windows [run length "
+				"[lookups]]]\n", argv[0]);
+		return 1;
+	}
+
+	static struct _XFreeFuncs freefuncs;
+	static struct _XDisplay blank = { .free_funcs = &freefuncs };
+	contextdpy = XOpenDisplay(NULL);
+	if (contextdpy == NULL)
+		contextdpy = &blank;
+
+	// Server allocated IDs: a client base plus a sequence.
+	Window *windows = xmalloc(nwindows * sizeof windows[0]);
+	struct listener *listeners = xmalloc(nwindows * sizeof listeners[0]);
+	context = XUniqueContext();
+	for (int i = 0; i < nwindows; i++) {
+		windows[i] = 0x1e00000 + (i << 2) + 1;
+		listeners[i] = (struct listener){ .name = "bench" };
+		setlistener(windows[i], &listeners[i]);
+		htinsert(&table, windows[i], &listeners[i]);
+		XSaveContext(contextdpy, windows[i], context,
+				(XPointer)&listeners[i]);
+	}
+
+	Window *events = xmalloc(nevents * sizeof events[0]);
+	srand(1);
+	for (unsigned long i = 0; i < nevents; ) {
+		Window w = windows[rand() % nwindows];
+		for (int k = 0; k < runlength && i < nevents; k++)
+			events[i++] = w;
+	}
+
+	printf("%d windows, runs of %d events, %lu lookups%s\n",
+			nwindows, runlength, nevents,
+			contextdpy == &blank ? " (no display)" : "");
+	run("XFindContext", findcontext, events, nevents);
+	run("hashtab", findtable, events, nevents);
+	run("getlistener", findlistener, events, nevents);
+	printf("getlistener cache hits: %lu of %lu\n",
+			stats.lookupcachehits, stats.lookups);
+
+	free(events);
+	free(listeners);
+	free(windows);
+	return 0;
+}
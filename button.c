@@ -48,6 +48,8 @@ static void expose(struct button *, XExposeEvent *);
 static void unmapnotify(struct button *, XUnmapEvent *);
 static void event(void *, XEvent *);
 
+static DEFINE_POOL(buttonpool, struct button);
+
 static void update(struct button *b)
 {
 	Bool invert = b->pressed && b->entered;
@@ -146,7 +148,7 @@ struct button *bcreate(void (*function)(void *, Time),
 		Window parent, int x, int y, int width,
 		int height, int gravity)
 {
-	struct button *b = xmalloc(sizeof *b);
+	struct button *b = palloc(&buttonpool);
 	b->function = function;
 	b->arg = arg;
 	b->bitmap = bitmap;
@@ -163,6 +165,7 @@ struct button *bcreate(void (*function)(void *, Time),
 				.win_gravity = gravity });
 	b->listener.function = event;
 	b->listener.pointer = b;
+	b->listener.name = "button";
 	setlistener(b->window, &b->listener);
 	XGrabButton(dpy, Button1, AnyModifier, b->window, False,
 			EnterWindowMask | LeaveWindowMask | ButtonReleaseMask,
@@ -180,5 +183,5 @@ void bdestroy(struct button *b)
 	setlistener(b->window, NULL);
 	XFreePixmap(dpy, b->pixmap);
 	XDestroyWindow(dpy, b->window);
-	free(b);
+	pfree(&buttonpool, b);
 }
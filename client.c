@@ -26,14 +26,59 @@
 #include <string.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xproto.h>
 #include <X11/Xutil.h>
 
 #include "list.h"
 #include "wind.h"
 
+/*
+ * Membership of a client in a group of clients sharing the same
+ * application id, or transient for the same window.
+ */
+struct member {
+	List node;
+	struct client *client;
+	struct group *group;	// NULL if not in a group
+};
+
+struct group {
+	XID id;
+	List members;	// in stacking order within each layer
+};
+
+/*
+ * Stacking layers, from the bottom up. Each layer is stacked
+ * entirely above the layers below it.
+ */
+enum {
+	LAYER_BELOW,
+	LAYER_NORMAL,
+	LAYER_ABOVE,
+	LAYER_DOCK,
+	LAYER_FULLSCREEN,
+	NLAYERS
+};
+
 struct client {
 	struct listener listener;
+
+	// Node in the list of clients in the same layer
 	List winstack;
+	int layer;
+
+	// Node in the list of clients on the same desk
+	List deskstack;
+
+	// Node in the focus history of the desk, and when the client
+	// last got the focus (zero if never, or pushed since)
+	List deskmru;
+	unsigned long focusstamp;
+
+	// Top-level window and its position in the stacking order
+	// at the last restack, or None if not restacked since then
+	Window stackwin;
+	int stackpos;
 	Window window;
 	Colormap colormap;
 
@@ -54,10 +99,41 @@ struct client {
 	// Application id of this client
 	XID app;
 
+	// Nodes in the application group and in the transients
+	// of wmtransientfor
+	struct member appmember;
+	struct member transmember;
+
 	struct frame *frame;
 
 	Desk desk;
 
+	// Index of the client in the rectangle store
+	int slot;
+
+	/*
+	 * Properties changed since the last call to updateclients,
+	 * and whether the frame needs to be redrawn. The client is
+	 * a member of the dirtyclients list if any of this is set.
+	 */
+	List dirty;
+	Atom *dirtyatoms;
+	int ndirtyatoms;
+	int dirtyatomslim;
+	Bool needsupdate;
+
+	/*
+	 * Properties changed by us, and the serial numbers of the
+	 * requests that changed them. The PropertyNotify events they
+	 * cause are not taken for changes by the client.
+	 */
+	struct ownprop {
+		Atom atom;
+		unsigned long serial;
+	} *ownprops;
+	int nownprops;
+	int ownpropslim;
+
 	/*
 	 * If this counter is zero when an UnmapNotify event
 	 * is received, the client is considered withdrawn.
@@ -68,6 +144,8 @@ struct client {
 	Bool hasfocus;
 	Bool isfull;
 	Bool isdock;
+	Bool isabove;
+	Bool isbelow;
 	Bool skiptaskbar;
 	Bool isundecorated;
 	Bool followdesk;
@@ -95,6 +173,10 @@ static void focusin(struct client *, XFocusChangeEvent *);
 static void focusout(struct client *, XFocusChangeEvent *);
 static void configurerequest(struct client *, XConfigureRequestEvent *);
 static void propertynotify(struct client *, XPropertyEvent *);
+static void reloadproperty(struct client *, Atom);
+static void cmarkdirty(struct client *);
+static void cupdateframe(struct client *);
+static void cupdate(struct client *);
 static void maprequest(struct client *, XMapRequestEvent *);
 static void unmapnotify(struct client *, XUnmapEvent *);
 static void destroynotify(struct client *, XDestroyWindowEvent *);
@@ -104,6 +186,20 @@ static void event(void *, XEvent *);
 static void cinstallcolormaps(struct client *);
 static void crelease(struct client *, int);
 static void getclientstack(struct client ***, int *);
+static void putclientstack(struct client **);
+static void *growbuf(void *, int *, int, size_t);
+static struct desk *getdesk(Desk);
+static List *getdesklist(Desk);
+static void cinsertmru(struct client *);
+static struct client *getmrutask(List *);
+static void cinsertdesk(struct client *);
+static void csetapp(struct client *, XID);
+static void csettransientfor(struct client *, Window);
+static void joingroup(struct hashtab *, XID, struct member *);
+static void leavegroup(struct hashtab *, struct member *);
+static List *getgroup(struct hashtab *, XID);
+static void popgroup(List *);
+static void movegroupmember(struct member *, Bool);
 static void csendwmproto(struct client *, Atom, Time);
 static void creframe(struct client *);
 static Bool cisframed(struct client *);
@@ -113,11 +209,137 @@ static void cunmanage(struct client *);
 static void cwithdraw(struct client *);
 static void smartpos(struct client *);
 static void randpos(struct geometry *);
-static Bool samedesk(struct client *, struct client *);
 static unsigned long overlaparea(struct geometry, struct geometry);
 static void move(struct client *, int, int);
+static void cupdatelayer(struct client *);
+static void cupdatetransientlayers(Window);
+static int newslot(struct client *);
+static void freeslot(int);
+static void cupdaterect(struct client *);
+static void wmchangestate(struct client *, XClientMessageEvent *);
+static struct client *manageprefetched(Window);
+
+static DEFINE_POOL(clientpool, struct client);
+
+// Clients in each layer, from the bottom (head) up
+static List winstack[NLAYERS];
+
+// Number of clients in all layers
+static int nclients = 0;
+
+/*
+ * Buffers for snapshots of the client stack. They are reused, so
+ * taking a snapshot does not allocate memory once the buffers have
+ * grown to the number of clients. Snapshots may be nested.
+ *
+ * The stack is not mirrored in an array kept up to date by cpop and
+ * cpush. Moving a client in such an array costs O(n) on every raise,
+ * and callers that change the stack while they iterate would still
+ * need a copy. Snapshots are taken rarely: at exit, and for the
+ * stacking property after a restack, which is O(n) anyway.
+ */
+static struct {
+	struct client **v;
+	int lim;
+	Bool inuse;
+} stackbufs[4];
+
+// Window stack buffers for getwindowstack and restack
+static Window *windowstack = NULL;
+static int windowstacklim = 0;
+static Window *restackv = NULL;
+static int restacklim = 0;
+
+// Work space for restack, one slot per client from the top down
+static struct stackslot {
+	struct client *client;
+	Window window;
+	int prev;	// previous slot in the longest ordered run
+	Bool keep;	// need not move
+} *stackslots = NULL;
+static int stackslotslim = 0;
+static int *runtails = NULL;
+static int runtailslim = 0;
+
+/*
+ * Clients on each desk, and sticky clients, in stacking order
+ * within each layer. Switching desks only needs to visit the
+ * clients on the old and the new desk. The focus history of each
+ * desk lists its clients by focusstamp, most recently focused first.
+ */
+static struct desk {
+	List clients;
+	List mru;
+} **desks = NULL;
+static Desk ndesks = 0;
+static struct desk sticky = {
+	.clients = { &sticky.clients, &sticky.clients },
+	.mru = { &sticky.mru, &sticky.mru },
+};
+
+// The client with the input focus, if any
+static struct client *focus = NULL;
+
+// Source of focus stamps
+static unsigned long lastfocusstamp = 0;
 
-static LIST_DEFINE(winstack);
+/*
+ * Outer rectangles of the clients, including frames and borders,
+ * and their desks. There is one array per field, indexed by client
+ * slot, so that placement can scan them without visiting each
+ * client and frame. Unused slots have a NULL owner.
+ */
+static struct {
+	int *x;
+	int *y;
+	int *width;
+	int *height;
+	Desk *desk;
+	struct client **owner;
+	int n;		// slots in use or free
+	int lim;
+	int *free;	// stack of unused slots
+	int nfree;
+} rects;
+
+// Managed clients by window
+static struct hashtab clients;
+
+// Application groups by id, and transients by the window they are for
+static struct hashtab apps;
+static struct hashtab transients;
+
+// Empty group, returned for unknown ids
+static LIST_DEFINE(nomembers);
+
+// Clients with changed properties or frames to redraw
+static LIST_DEFINE(dirtyclients);
+
+/*
+ * Handlers for client property changes and client messages,
+ * keyed by atom. Several modules may handle the same atom.
+ */
+struct prophandler {
+	void (*function)(struct client *);
+	struct prophandler *next;
+};
+
+struct msghandler {
+	void (*function)(struct client *, XClientMessageEvent *);
+	struct msghandler *next;
+};
+
+static struct hashtab prophandlers;
+static struct hashtab msghandlers;
+
+// Properties read when a window is managed, fetched in advance
+static Atom *prefetchatoms = NULL;
+static int nprefetchatoms = 0;
+static int prefetchatomslim = 0;
+
+// Events selected on client windows
+#define CLIENTMASK (StructureNotifyMask | PropertyChangeMask | \
+		ColormapChangeMask | FocusChangeMask)
 
 // Current desk
 static Desk curdesk = 0;
@@ -156,13 +378,10 @@ void setndesk(Desk val)
 	if (curdesk >= val)
 		gotodesk(val - 1);
 
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-	for (int i = n - 1; i >= 0; i--)
-		if (v[i]->desk != DESK_ALL && v[i]->desk >= val)
-			csetdesk(v[i], val - 1);
-	free(v);
+	for (Desk d = val; d < ndesks; d++)
+		while (!LIST_EMPTY(&desks[d]->clients))
+			csetdesk(LIST_ITEM(LIST_HEAD(&desks[d]->clients),
+					struct client, deskstack), val - 1);
 
 	if (val < oldval)
 		ewmh_notifyndesk(val);
@@ -173,38 +392,38 @@ void gotodesk(Desk d)
 	if (d == curdesk || d >= ndesk || d == DESK_ALL)
 		return;
 
+	List *old = getdesklist(curdesk);
+	List *new = getdesklist(d);
 	curdesk = d;
 
 	/*
 	 * Minimize the number of window exposures by first mapping
 	 * windows from the new desk top-down, and then unmapping
-	 * the windows from the old desk bottom-up.
+	 * the windows from the old desk bottom-up. Sticky windows
+	 * stay mapped.
 	 */
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-	for (int i = n - 1; i >= 0; i--)
-		if (cisvisible(v[i]))
-			cmap(v[i]);
-	for (int i = 0; i < n; i++)
-		if (v[i]->followdesk && v[i]->desk != DESK_ALL)
-			csetdesk(v[i], curdesk);
-		else if (!cisvisible(v[i]))
-			cunmap(v[i]);
-	free(v);
+	List *lp;
+	LIST_FOREACH_REV(lp, new)
+		cmap(LIST_ITEM(lp, struct client, deskstack));
+	lp = old->next;
+	while (lp != old) {
+		struct client *c = LIST_ITEM(lp, struct client, deskstack);
+		lp = lp->next;
+		if (c->followdesk)
+			csetdesk(c, curdesk);
+		else
+			cunmap(c);
+	}
 
 	ewmh_notifycurdesk(curdesk);
 }
 
 void csetappdesk(struct client *c, Desk d)
 {
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-	for (int i = 0; i < n; i++)
-		if (v[i]->app == c->app)
-			csetdesk(v[i], d);
-	free(v);
+	List *g = getgroup(&apps, c->app);
+	List *lp;
+	LIST_FOREACH(lp, g)
+		csetdesk(LIST_ITEM(lp, struct member, node)->client, d);
 }
 
 void csetdesk(struct client *c, Desk d)
@@ -212,7 +431,14 @@ void csetdesk(struct client *c, Desk d)
 	if (d >= ndesk && d != DESK_ALL)
 		d = ndesk - 1;
 
-	c->desk = d;
+	if (d != c->desk) {
+		LIST_REMOVE(&c->deskstack);
+		LIST_REMOVE(&c->deskmru);
+		c->desk = d;
+		rects.desk[c->slot] = d;
+		cinsertdesk(c);
+		cinsertmru(c);
+	}
 	ewmh_notifyclientdesktop(c->window, d);
 
 	if (cisvisible(c))
@@ -221,8 +447,7 @@ void csetdesk(struct client *c, Desk d)
 		cunmap(c);
 
 	// May have become sticky
-	if (c->frame != NULL)
-		fupdate(c->frame);
+	cupdateframe(c);
 }
 
 Desk cgetdesk(struct client *c)
@@ -234,6 +459,74 @@ void csetdock(struct client *c, Bool isdock)
 {
 	c->isdock = isdock;
 	creframe(c);
+	cupdatelayer(c);
+}
+
+void csetabove(struct client *c, Bool isabove)
+{
+	c->isabove = isabove;
+	cupdatelayer(c);
+}
+
+void csetbelow(struct client *c, Bool isbelow)
+{
+	c->isbelow = isbelow;
+	cupdatelayer(c);
+}
+
+/*
+ * Move the client to the top of the layer given by its state.
+ * Transients are kept at least in the layer of their owner, so
+ * that dialogs don't disappear behind fullscreen windows.
+ */
+static void cupdatelayer(struct client *c)
+{
+	int layer = LAYER_NORMAL;
+	if (c->isfull)
+		layer = LAYER_FULLSCREEN;
+	else if (c->isdock)
+		layer = LAYER_DOCK;
+	else if (c->isabove)
+		layer = LAYER_ABOVE;
+	else if (c->isbelow)
+		layer = LAYER_BELOW;
+	if (c->wmtransientfor != None) {
+		struct client *owner = htfind(&clients, c->wmtransientfor);
+		if (owner != NULL && owner->layer > layer)
+			layer = owner->layer;
+	}
+	if (layer == c->layer)
+		return;
+
+	LIST_REMOVE(&c->winstack);
+	c->layer = layer;
+	LIST_INSERT_TAIL(&winstack[layer], &c->winstack);
+	LIST_REMOVE(&c->deskstack);
+	LIST_INSERT_TAIL(getdesklist(c->desk), &c->deskstack);
+	movegroupmember(&c->appmember, True);
+	movegroupmember(&c->transmember, True);
+	needrestack = True;
+	stats.restackrequests++;
+
+	cupdatetransientlayers(c->window);
+}
+
+/*
+ * Update the layers of the transients of a window.
+ */
+static void cupdatetransientlayers(Window owner)
+{
+	/*
+	 * Moving a transient puts it at the end of the group,
+	 * where it is visited again without effect.
+	 */
+	List *g = getgroup(&transients, owner);
+	List *lp = g->next;
+	while (lp != g) {
+		List *next = lp->next;
+		cupdatelayer(LIST_ITEM(lp, struct member, node)->client);
+		lp = next;
+	}
 }
 
 void csetfull(struct client *c, Bool enabled)
@@ -244,8 +537,11 @@ void csetfull(struct client *c, Bool enabled)
 		if (c->frame != NULL) {
 			fdestroy(c->frame);
 			c->frame = NULL;
+			c->stackwin = None;
 		}
 		c->isfull = True;
+		cupdatelayer(c);
+		TRACK(X_ConfigureWindow, c->window);
 		XMoveResizeWindow(dpy, c->window,
 				-c->geometry.borderwidth,
 				-c->geometry.borderwidth,
@@ -255,22 +551,28 @@ void csetfull(struct client *c, Bool enabled)
 			cmap(c);
 		if (f)
 			cfocus(c, CurrentTime);
-		ewmh_notifyfull(c->window, True);
+		cupdaterect(c);
+		ewmh_notifyfull(c, True);
 	} else if (!enabled && c->isfull) {
 		assert(c->frame == NULL);
 		Bool f = c->hasfocus;
 		cunmap(c);
 		c->isfull = False;
+		cupdatelayer(c);
+		TRACK(X_ConfigureWindow, c->window);
 		XMoveResizeWindow(dpy, c->window,
 				c->geometry.x, c->geometry.y,
 				c->geometry.width, c->geometry.height);
-		if (cisframed(c))
+		if (cisframed(c)) {
 			c->frame = fcreate(c);
+			c->stackwin = None;
+		}
 		if (cisvisible(c))
 			cmap(c);
 		if (f)
 			cfocus(c, CurrentTime);
-		ewmh_notifyfull(c->window, False);
+		cupdaterect(c);
+		ewmh_notifyfull(c, False);
 	}
 }
 
@@ -282,33 +584,31 @@ void csetundecorated(struct client *c, Bool enabled)
 
 void csetappfollowdesk(struct client *c, Bool enabled)
 {
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-	for (int i = 0; i < n; i++)
-		if (v[i]->app == c->app)
-			v[i]->followdesk = enabled;
-	free(v);
+	List *g = getgroup(&apps, c->app);
+	List *lp;
+	LIST_FOREACH(lp, g)
+		LIST_ITEM(lp, struct member, node)->client->followdesk =
+				enabled;
 }
 
 /*
  * Return client window stack, from bottom (first) to top (last).
- * Caller deallocates using free(3).
+ * The array is valid until the next call, and must not be freed.
  */
 void getwindowstack(Window **vp, size_t *np)
 {
 	List *lp;
 
-	size_t n = 0;
-	LIST_FOREACH(lp, &winstack)
-		n++;
-
-	Window *v = xmalloc(n * sizeof v[0]);
+	size_t n = nclients;
+	Window *v = windowstack = growbuf(windowstack, &windowstacklim,
+			nclients, sizeof *windowstack);
 	size_t i = 0;
-	LIST_FOREACH(lp, &winstack) {
-		struct client *c = LIST_ITEM(lp, struct client, winstack);
-		v[i++] = c->window;
-	}
+	for (int l = 0; l < NLAYERS; l++)
+		LIST_FOREACH(lp, &winstack[l]) {
+			struct client *c = LIST_ITEM(lp, struct client,
+					winstack);
+			v[i++] = c->window;
+		}
 
 	*vp = v;
 	*np = n;
@@ -316,117 +616,426 @@ void getwindowstack(Window **vp, size_t *np)
 
 void cpushapp(struct client *c)
 {
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-	for (int i = n - 1; i >= 0; i--)
-		if (v[i]->app == c->app)
-			cpush(v[i]);
-	free(v);
+	List *g = getgroup(&apps, c->app);
+	List *lp;
+
+	// Forget that the application had the focus.
+	LIST_FOREACH(lp, g) {
+		struct client *x = LIST_ITEM(lp, struct member, node)->client;
+		if (x->focusstamp != 0) {
+			x->focusstamp = 0;
+			LIST_REMOVE(&x->deskmru);
+			LIST_INSERT_TAIL(&getdesk(x->desk)->mru, &x->deskmru);
+		}
+	}
+
+	/*
+	 * Push the members top-down. Each one moves to the head of
+	 * the group, so stop after the one that was first.
+	 */
+	List *first = g->next;
+	lp = g->prev;
+	while (lp != g) {
+		List *prev = lp->prev;
+		cpush(LIST_ITEM(lp, struct member, node)->client);
+		if (lp == first)
+			break;
+		lp = prev;
+	}
 }
 
 void cpopapp(struct client *c)
 {
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-
-	for (int i = 0; i < n; i++)
-		if (v[i]->app == c->app)
-			cpop(v[i]);
+	popgroup(getgroup(&apps, c->app));
 
 	if (c->wmtransientfor != None) {
-		for (int i = 0; i < n; i++)
-			if (v[i]->window == c->wmtransientfor) {
-				cpop(v[i]);
-				break;
-			}
-		for (int i = 0; i < n; i++)
-			if (v[i]->wmtransientfor == c->wmtransientfor)
-				cpop(v[i]);
+		struct client *owner = htfind(&clients, c->wmtransientfor);
+		if (owner != NULL)
+			cpop(owner);
+		popgroup(getgroup(&transients, c->wmtransientfor));
 		cpop(c);
 	} else {
 		cpop(c);
-		for (int i = 0; i < n; i++)
-			if (v[i]->wmtransientfor == c->window)
-				cpop(v[i]);
+		popgroup(getgroup(&transients, c->window));
 	}
+}
 
-	free(v);
+/*
+ * Pop the members of a group bottom-up. Each one moves to the
+ * tail of the group, so stop after the one that was last.
+ */
+static void popgroup(List *g)
+{
+	List *last = g->prev;
+	List *lp = g->next;
+	while (lp != g) {
+		List *next = lp->next;
+		cpop(LIST_ITEM(lp, struct member, node)->client);
+		if (lp == last)
+			break;
+		lp = next;
+	}
 }
 
 /*
- * Return client stack, from bottom (first) to top (last).
- * Caller deallocates using free(3).
+ * Return the members of the group with the specified id.
+ */
+static List *getgroup(struct hashtab *t, XID id)
+{
+	struct group *g = htfind(t, id);
+	return g == NULL ? &nomembers : &g->members;
+}
+
+/*
+ * Add a member to a group, at the position given by the place
+ * of its client in its layer.
+ */
+static void joingroup(struct hashtab *t, XID id, struct member *m)
+{
+	struct group *g = htfind(t, id);
+	if (g == NULL) {
+		g = xmalloc(sizeof *g);
+		g->id = id;
+		LIST_INIT(&g->members);
+		htinsert(t, id, g);
+	}
+
+	m->group = g;
+
+	// The member is at the same offset in every client.
+	size_t offset = (char *)m - (char *)m->client;
+	List *layer = &winstack[m->client->layer];
+	for (List *lp = m->client->winstack.next; lp != layer;
+			lp = lp->next) {
+		struct client *above = LIST_ITEM(lp, struct client, winstack);
+		struct member *am = (struct member *)((char *)above + offset);
+		if (am->group == g) {
+			LIST_INSERT_BEFORE(&am->node, &m->node);
+			return;
+		}
+	}
+	LIST_INSERT_TAIL(&g->members, &m->node);
+}
+
+static void leavegroup(struct hashtab *t, struct member *m)
+{
+	struct group *g = m->group;
+	if (g == NULL)
+		return;
+	LIST_REMOVE(&m->node);
+	m->group = NULL;
+	if (LIST_EMPTY(&g->members)) {
+		htremove(t, g->id);
+		free(g);
+	}
+}
+
+/*
+ * Move a member to the top (tail) or bottom (head) of its group.
+ */
+static void movegroupmember(struct member *m, Bool top)
+{
+	if (m->group != NULL) {
+		LIST_REMOVE(&m->node);
+		if (top)
+			LIST_INSERT_TAIL(&m->group->members, &m->node);
+		else
+			LIST_INSERT_HEAD(&m->group->members, &m->node);
+	}
+}
+
+static void csetapp(struct client *c, XID app)
+{
+	if (c->appmember.group != NULL && c->app == app)
+		return;
+	leavegroup(&apps, &c->appmember);
+	c->app = app;
+	joingroup(&apps, app, &c->appmember);
+}
+
+static void csettransientfor(struct client *c, Window w)
+{
+	if (c->transmember.group != NULL && c->wmtransientfor == w)
+		return;
+	leavegroup(&transients, &c->transmember);
+	c->wmtransientfor = w;
+	if (w != None)
+		joingroup(&transients, w, &c->transmember);
+	cupdatelayer(c);
+}
+
+/*
+ * Return a snapshot of the client stack, from bottom (first) to top
+ * (last). The caller may modify it, and returns it with
+ * putclientstack.
  */
 static void getclientstack(struct client ***vp, int *np)
 {
-	int n = 0;
-	List *lp;
-	LIST_FOREACH(lp, &winstack)
-		n++;
-	struct client **v = xmalloc(n * sizeof *v);
+	int k = 0;
+	while (stackbufs[k].inuse) {
+		k++;
+		assert(k < NELEM(stackbufs));
+	}
+	stackbufs[k].inuse = True;
+	stats.stacksnapshots++;
+
+	// Never empty, so that putclientstack can tell buffers apart
+	struct client **v = stackbufs[k].v = growbuf(stackbufs[k].v,
+			&stackbufs[k].lim, MAX(nclients, 1), sizeof *v);
 	struct client **p = v;
-	LIST_FOREACH(lp, &winstack)
-		*p++ = LIST_ITEM(lp, struct client, winstack);
+	List *lp;
+	for (int l = 0; l < NLAYERS; l++)
+		LIST_FOREACH(lp, &winstack[l])
+			*p++ = LIST_ITEM(lp, struct client, winstack);
 	*vp = v;
-	*np = n;
+	*np = nclients;
+}
+
+static void putclientstack(struct client **v)
+{
+	for (int k = 0; k < NELEM(stackbufs); k++)
+		if (stackbufs[k].v == v) {
+			stackbufs[k].inuse = False;
+			return;
+		}
+	assert(False);
+}
+
+/*
+ * Make room for n elements of the specified size in a buffer of
+ * *limp elements, growing it geometrically.
+ */
+static void *growbuf(void *v, int *limp, int n, size_t size)
+{
+	if (n > *limp) {
+		*limp = MAX(n, 2 * *limp);
+		v = xrealloc(v, *limp * size);
+		stats.stackallocs++;
+	}
+	return v;
 }
 
+/*
+ * Return the list of clients on desk d, or the sticky clients
+ * if d is DESK_ALL.
+ */
+static struct desk *getdesk(Desk d)
+{
+	if (d == DESK_ALL)
+		return &sticky;
+	if (d >= ndesks) {
+		desks = xrealloc(desks, (d + 1) * sizeof *desks);
+		for (; ndesks <= d; ndesks++) {
+			desks[ndesks] = xmalloc(sizeof *desks[ndesks]);
+			LIST_INIT(&desks[ndesks]->clients);
+			LIST_INIT(&desks[ndesks]->mru);
+		}
+	}
+	return desks[d];
+}
+
+static List *getdesklist(Desk d)
+{
+	return &getdesk(d)->clients;
+}
+
+/*
+ * Insert the client in the focus history of its desk, at the
+ * position given by its focus stamp.
+ */
+static void cinsertmru(struct client *c)
+{
+	List *mru = &getdesk(c->desk)->mru;
+	List *lp;
+	LIST_FOREACH(lp, mru)
+		if (LIST_ITEM(lp, struct client, deskmru)->focusstamp <=
+				c->focusstamp)
+			break;
+	LIST_INSERT_BEFORE(lp, &c->deskmru);
+}
+
+/*
+ * Return the most recently focused task in a focus history.
+ * Returns NULL if none of the tasks has been focused.
+ */
+static struct client *getmrutask(List *mru)
+{
+	List *lp;
+	LIST_FOREACH(lp, mru) {
+		struct client *c = LIST_ITEM(lp, struct client, deskmru);
+		if (c->focusstamp == 0)
+			break;
+		if (cistask(c))
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * Insert the client in the list of its desk, at the position
+ * given by its place in its layer.
+ */
+static void cinsertdesk(struct client *c)
+{
+	List *l = getdesklist(c->desk);
+	List *layer = &winstack[c->layer];
+	for (List *lp = c->winstack.next; lp != layer; lp = lp->next) {
+		struct client *above = LIST_ITEM(lp, struct client, winstack);
+		if (above->desk == c->desk) {
+			LIST_INSERT_BEFORE(&above->deskstack, &c->deskstack);
+			return;
+		}
+	}
+	LIST_INSERT_TAIL(l, &c->deskstack);
+}
+
+/*
+ * Raise a client to the top of its layer. The lists of its desk
+ * and its groups get the same change, which keeps them in stacking
+ * order within each layer.
+ */
 static void cpop(struct client *c)
 {
-	if (LIST_TAIL(&winstack) != &c->winstack) {
+	if (LIST_TAIL(&winstack[c->layer]) != &c->winstack) {
 		LIST_REMOVE(&c->winstack);
-		LIST_INSERT_TAIL(&winstack, &c->winstack);
+		LIST_INSERT_TAIL(&winstack[c->layer], &c->winstack);
+		LIST_REMOVE(&c->deskstack);
+		LIST_INSERT_TAIL(getdesklist(c->desk), &c->deskstack);
+		movegroupmember(&c->appmember, True);
+		movegroupmember(&c->transmember, True);
 		needrestack = True;
+		stats.restackrequests++;
 	}
 }
 
 static void cpush(struct client *c)
 {
-	if (LIST_HEAD(&winstack) != &c->winstack) {
+	if (LIST_HEAD(&winstack[c->layer]) != &c->winstack) {
 		LIST_REMOVE(&c->winstack);
-		LIST_INSERT_HEAD(&winstack, &c->winstack);
+		LIST_INSERT_HEAD(&winstack[c->layer], &c->winstack);
+		LIST_REMOVE(&c->deskstack);
+		LIST_INSERT_HEAD(getdesklist(c->desk), &c->deskstack);
+		movegroupmember(&c->appmember, False);
+		movegroupmember(&c->transmember, False);
 		needrestack = True;
+		stats.restackrequests++;
 	}
 }
 
+/*
+ * Bring the server stacking order up to date.
+ *
+ * Clients that kept their relative order since the last restack
+ * stay where they are. The longest run of such clients is found
+ * from their previous positions, and only the other clients are
+ * moved, each to just below the window above it. Clients whose
+ * top-level window changed are always moved.
+ */
 void restack(void)
 {
 	if (!needrestack)
 		return;
-	int n = 1;
-	List *lp;
-	LIST_FOREACH(lp, &winstack)
-		n++;
-	Window *v = xmalloc(n * sizeof *v);
-	int i = 0;
 	assert(stacktop != None);
-	v[i++] = stacktop;
-	LIST_FOREACH_REV(lp, &winstack) {
-		struct client *c = LIST_ITEM(lp, struct client, winstack);
-		v[i++] = c->frame == NULL ? c->window : fgetwin(c->frame);
-	}
+
+	int n = nclients;
+	struct stackslot *v = stackslots = growbuf(stackslots,
+			&stackslotslim, n, sizeof *v);
+	int *tails = runtails = growbuf(runtails, &runtailslim, n,
+			sizeof *tails);
+
+	int i = 0;
+	List *lp;
+	for (int l = NLAYERS - 1; l >= 0; l--)
+		LIST_FOREACH_REV(lp, &winstack[l]) {
+			struct client *c = LIST_ITEM(lp, struct client,
+					winstack);
+			v[i].client = c;
+			v[i].window = c->frame == NULL ?
+					c->window : fgetwin(c->frame);
+			v[i].prev = -1;
+			v[i].keep = False;
+			i++;
+		}
 	assert(i == n);
-	XRestackWindows(dpy, v, n);
-	free(v);
+
+	// Find the longest run in increasing previous position.
+	int len = 0;
+	for (i = 0; i < n; i++) {
+		struct client *c = v[i].client;
+		if (c->stackwin == v[i].window) {
+			int lo = 0;
+			int hi = len;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (v[tails[mid]].client->stackpos <
+						c->stackpos)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo > 0)
+				v[i].prev = tails[lo - 1];
+			tails[lo] = i;
+			if (lo == len)
+				len++;
+		}
+	}
+	for (int k = len > 0 ? tails[len - 1] : -1; k != -1; k = v[k].prev)
+		v[k].keep = True;
+
+	/*
+	 * Xlib restacks n windows with n - 1 ConfigureWindow requests,
+	 * so moving the others one by one never takes more requests.
+	 * Restack everything only if nothing can stay.
+	 */
+	if (len > 0) {
+		for (i = 0; i < n; i++)
+			if (!v[i].keep) {
+				TRACK(X_ConfigureWindow, v[i].window);
+				XConfigureWindow(dpy, v[i].window,
+						CWSibling | CWStackMode,
+						&(XWindowChanges){
+						.sibling = i == 0 ? stacktop :
+								v[i - 1].window,
+						.stack_mode = Below });
+				stats.restackmoves++;
+			}
+	} else {
+		Window *w = restackv = growbuf(restackv, &restacklim,
+				n + 1, sizeof *w);
+		w[0] = stacktop;
+		for (i = 0; i < n; i++)
+			w[i + 1] = v[i].window;
+		TRACK(X_ConfigureWindow, stacktop);
+		XRestackWindows(dpy, w, n + 1);
+		stats.restackmoves += n;
+	}
+
+	for (i = 0; i < n; i++) {
+		v[i].client->stackwin = v[i].window;
+		v[i].client->stackpos = i;
+	}
+
 	needrestack = False;
+	stats.restacks++;
 	ewmh_notifyrestack();
 }
 
 static void reloadwmtransientfor(struct client *c)
 {
-	c->wmtransientfor = None;
-	XGetTransientForHint(dpy, c->window, &c->wmtransientfor);
+	csettransientfor(c, gettransientfor(c->window));
 
 	if (c->wmtransientfor != None) {
-		c->app = c->wmtransientfor;
-		XWMHints *h = XGetWMHints(dpy, c->wmtransientfor);
-		if (h != NULL) {
-			if (h->flags & WindowGroupHint)
-				c->app = h->window_group;
+		XID app = c->wmtransientfor;
+		// The hints of a managed owner are already at hand.
+		struct client *owner = htfind(&clients, c->wmtransientfor);
+		XWMHints *h = owner != NULL ?
+				owner->wmhints : getwmhints(c->wmtransientfor);
+		if (h != NULL && (h->flags & WindowGroupHint))
+			app = h->window_group;
+		if (h != NULL && owner == NULL)
 			XFree(h);
-		}
+		csetapp(c, app);
 		cupdatedesk(c);
 	}
 }
@@ -435,14 +1044,15 @@ static void reloadwmhints(struct client *c)
 {
 	if (c->wmhints != NULL)
 		XFree(c->wmhints);
-	c->wmhints = XGetWMHints(dpy, c->window);
+	c->wmhints = getwmhints(c->window);
 
 	if (c->wmtransientfor == None) {
-		c->app = c->window;
+		XID app = c->window;
 		if (c->wmhints != NULL) {
 			if (c->wmhints->flags & WindowGroupHint)
-				c->app = c->wmhints->window_group;
+				app = c->wmhints->window_group;
 		}
+		csetapp(c, app);
 		cupdatedesk(c);
 	}
 
@@ -460,25 +1070,16 @@ static void reloadwmnormalhints(struct client *c)
 		c->wmnormalhints = XAllocSizeHints();
 	if (c->wmnormalhints != NULL) {
 		c->wmnormalhints->flags = 0;
-		long dummy;
-		XGetWMNormalHints(dpy, c->window, c->wmnormalhints, &dummy);
+		getwmnormalhints(c->window, c->wmnormalhints);
 	}
 }
 
 static void reloadwmname(struct client *c)
 {
 	free(c->wmname);
-	c->wmname = NULL;
+	c->wmname = getwmname(c->window);
 
-	XTextProperty p;
-	if (XGetWMName(dpy, c->window, &p) != 0) {
-		c->wmname = decodetextproperty(&p);
-		if (p.value != NULL)
-			XFree(p.value);
-	}
-
-	if (c->frame != NULL)
-		fupdate(c->frame);
+	cupdateframe(c);
 }
 
 static void reloadwmprotocols(struct client *c)
@@ -487,34 +1088,30 @@ static void reloadwmprotocols(struct client *c)
 		XFree(c->wmprotocols);
 		c->wmprotocols = NULL;
 	}
-	c->wmprotocolscount = 0;
-	XGetWMProtocols(dpy, c->window,
-			&c->wmprotocols, &c->wmprotocolscount);
+	c->wmprotocols = getwmprotocols(c->window, &c->wmprotocolscount);
 
-	if (c->frame != NULL)
-		fupdate(c->frame);
+	cupdateframe(c);
 }
 
 static void cupdatedesk(struct client *c)
 {
 	Desk d = c->desk;
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
 	if (c->wmtransientfor != None) {
-		for (int i = n - 1; i >= 0; i--)
-			if (v[i]->window == c->wmtransientfor) {
-				d = v[i]->desk;
-				break;
-			}
+		struct client *owner = htfind(&clients, c->wmtransientfor);
+		if (owner != NULL)
+			d = owner->desk;
 	} else if (c->app != c->window) {
-		for (int i = n - 1; i >= 0; i--)
-			if (v[i]->app == c->app && v[i] != c) {
-				d = v[i]->desk;
+		List *g = getgroup(&apps, c->app);
+		List *lp;
+		LIST_FOREACH_REV(lp, g) {
+			struct client *x =
+					LIST_ITEM(lp, struct member, node)->client;
+			if (x != c) {
+				d = x->desk;
 				break;
 			}
+		}
 	}
-	free(v);
 	if (d != c->desk)
 		csetdesk(c, d);
 }
@@ -577,6 +1174,10 @@ static void focusin(struct client *c, XFocusChangeEvent *e)
 		return;
 
 	c->hasfocus = True;
+	focus = c;
+	c->focusstamp = ++lastfocusstamp;
+	LIST_REMOVE(&c->deskmru);
+	LIST_INSERT_HEAD(&getdesk(c->desk)->mru, &c->deskmru);
 
 	ungrabbutton(AnyButton, AnyModifier, c->window);
 
@@ -603,6 +1204,8 @@ static void focusout(struct client *c, XFocusChangeEvent *e)
 		return;
 
 	c->hasfocus = False;
+	if (focus == c)
+		focus = NULL;
 
 	grabbutton(AnyButton, AnyModifier, c->window, True, 0,
 			GrabModeSync, GrabModeAsync, None, None);
@@ -629,6 +1232,8 @@ static void configurerequest(struct client *c, XConfigureRequestEvent *e)
 		return;
 	}
 
+	compressconfrequest(e);
+
 	if (c->isfull) {
 		// Deny fullscreen windows to reconfigure themselves.
 		csendconf(c);
@@ -649,6 +1254,7 @@ static void configurerequest(struct client *c, XConfigureRequestEvent *e)
 	if (mask & CWBorderWidth)
 		c->geometry.borderwidth = e->border_width;
 
+	TRACK(X_ConfigureWindow, c->window);
 	XConfigureWindow(dpy, c->window, mask,
 			&(XWindowChanges){
 				.x = c->geometry.x,
@@ -658,29 +1264,141 @@ static void configurerequest(struct client *c, XConfigureRequestEvent *e)
 				.border_width = c->geometry.borderwidth });
 }
 
+/*
+ * Property changes are not acted upon immediately. Applications
+ * tend to change properties such as their window name in bursts,
+ * so changed properties are collected and reloaded only once by
+ * updateclients at the end of the event batch.
+ */
 static void propertynotify(struct client *c, XPropertyEvent *e)
 {
-	switch (e->atom) {
-	case XA_WM_NAME:
-		reloadwmname(c);
-		break;
-	case XA_WM_HINTS:
-		reloadwmhints(c);
-		break;
-	case XA_WM_NORMAL_HINTS:
-		reloadwmnormalhints(c);
-		break;
-	case XA_WM_TRANSIENT_FOR:
-		reloadwmtransientfor(c);
-		break;
-	default:
-		if (e->atom == WM_PROTOCOLS)
-			reloadwmprotocols(c);
-		break;
+	stats.propevents++;
+
+	if (htfind(&prophandlers, e->atom) == NULL)
+		return;
+
+	/*
+	 * Find out if this is our own change. Events for the same
+	 * property that are older than this one will not come.
+	 */
+	Bool own = False;
+	int k = 0;
+	for (int i = 0; i < c->nownprops; i++) {
+		struct ownprop *p = &c->ownprops[i];
+		if (p->atom == e->atom && p->serial == e->serial && !own)
+			own = True;
+		else if (p->atom != e->atom || p->serial > e->serial)
+			c->ownprops[k++] = *p;
 	}
+	c->nownprops = k;
+	if (own)
+		return;
+
+	for (int i = 0; i < c->ndirtyatoms; i++)
+		if (c->dirtyatoms[i] == e->atom)
+			return;
 
-	ewmh_propertynotify(c, e);
-	mwm_propertynotify(c, e);
+	if (c->ndirtyatoms == c->dirtyatomslim) {
+		c->dirtyatomslim += 8;
+		c->dirtyatoms = xrealloc(c->dirtyatoms,
+				c->dirtyatomslim * sizeof c->dirtyatoms[0]);
+	}
+	c->dirtyatoms[c->ndirtyatoms++] = e->atom;
+	cmarkdirty(c);
+}
+
+/*
+ * Tells that the next request changes a property of the client
+ * window, so that the change is not reloaded as if the client
+ * had made it.
+ */
+void cownprop(struct client *c, Atom atom)
+{
+	if (c->nownprops == c->ownpropslim) {
+		c->ownpropslim += 4;
+		c->ownprops = xrealloc(c->ownprops,
+				c->ownpropslim * sizeof c->ownprops[0]);
+	}
+	c->ownprops[c->nownprops++] = (struct ownprop){
+		.atom = atom,
+		.serial = NextRequest(dpy)
+	};
+}
+
+static void reloadproperty(struct client *c, Atom atom)
+{
+	stats.propreloads++;
+	for (struct prophandler *h = htfind(&prophandlers, atom);
+			h != NULL; h = h->next)
+		h->function(c);
+}
+
+static void cmarkdirty(struct client *c)
+{
+	if (!LIST_MEMBER(&c->dirty))
+		LIST_INSERT_TAIL(&dirtyclients, &c->dirty);
+}
+
+/*
+ * Redraw the frame, if any, at the end of the event batch.
+ */
+static void cupdateframe(struct client *c)
+{
+	if (c->frame != NULL) {
+		c->needsupdate = True;
+		cmarkdirty(c);
+	}
+}
+
+/*
+ * Reload the changed properties of a client and redraw its frame.
+ */
+static void cupdate(struct client *c)
+{
+	LIST_REMOVE(&c->dirty);
+
+	// Reloading may change properties again.
+	while (c->ndirtyatoms > 0) {
+		Atom atom = c->dirtyatoms[0];
+		c->dirtyatoms[0] = c->dirtyatoms[--c->ndirtyatoms];
+		reloadproperty(c, atom);
+	}
+
+	if (LIST_MEMBER(&c->dirty))
+		LIST_REMOVE(&c->dirty);
+	if (c->needsupdate) {
+		c->needsupdate = False;
+		if (c->frame != NULL)
+			fupdate(c->frame);
+	}
+}
+
+/*
+ * Reload changed properties and redraw frames. This is done
+ * once after each batch of events.
+ */
+void updateclients(void)
+{
+	/*
+	 * Fetch the changed properties of all clients at once, so
+	 * that reloading them costs one round trip in all.
+	 */
+	List *lp;
+	LIST_FOREACH(lp, &dirtyclients) {
+		struct client *c = LIST_ITEM(lp, struct client, dirty);
+		if (c->ndirtyatoms > 0)
+			prefetchprops(c->window, c->dirtyatoms,
+					c->ndirtyatoms);
+	}
+	prefetchwait();
+
+	while (!LIST_EMPTY(&dirtyclients)) {
+		struct client *c = LIST_ITEM(LIST_HEAD(&dirtyclients),
+				struct client, dirty);
+		Window w = c->window;
+		cupdate(c);
+		prefetchdrop(w);
+	}
 }
 
 /*
@@ -712,8 +1430,14 @@ static void destroynotify(struct client *c, XDestroyWindowEvent *e)
 
 static void clientmessage(struct client *c, XClientMessageEvent *e)
 {
-	if (e->message_type == WM_CHANGE_STATE && e->format == 32 &&
-			e->data.l[0] == IconicState) {
+	for (struct msghandler *h = htfind(&msghandlers, e->message_type);
+			h != NULL; h = h->next)
+		h->function(c, e);
+}
+
+static void wmchangestate(struct client *c, XClientMessageEvent *e)
+{
+	if (e->format == 32 && e->data.l[0] == IconicState) {
 		/*
 		 * Wind doesn't allow hidden windows, so just push it.
 		 */
@@ -721,8 +1445,6 @@ static void clientmessage(struct client *c, XClientMessageEvent *e)
 		if (chasfocus(c))
 			refocus(CurrentTime);
 	}
-
-	ewmh_clientmessage(c, e);
 }
 
 static void colormapnotify(struct client *c, XColormapEvent *e)
@@ -736,6 +1458,16 @@ static void colormapnotify(struct client *c, XColormapEvent *e)
 
 static void event(void *self, XEvent *e)
 {
+	struct client *c = self;
+
+	/*
+	 * Bring the properties up to date before acting on any
+	 * other event, except when the window is going away.
+	 */
+	if (LIST_MEMBER(&c->dirty) && e->type != PropertyNotify &&
+			e->type != UnmapNotify && e->type != DestroyNotify)
+		cupdate(c);
+
 	switch (e->type) {
 	case ButtonPress:
 		buttonpress(self, &e->xbutton);
@@ -775,6 +1507,63 @@ static void event(void *self, XEvent *e)
 	}
 }
 
+/*
+ * Call function whenever the property atom of a client has changed.
+ * Changes are reported once per event batch, and only for atoms
+ * that some module has registered a handler for.
+ */
+void addprophandler(Atom atom, void (*function)(struct client *))
+{
+	if (htfind(&prophandlers, atom) == NULL)
+		addprefetch(atom);
+
+	struct prophandler *h = xmalloc(sizeof *h);
+	h->function = function;
+	h->next = htfind(&prophandlers, atom);
+	htinsert(&prophandlers, atom, h);
+}
+
+/*
+ * Registers a property to be fetched along with the others when a
+ * window is managed. Properties with a handler are registered
+ * already.
+ */
+void addprefetch(Atom atom)
+{
+	if (nprefetchatoms == prefetchatomslim) {
+		prefetchatomslim = MAX(16, 2 * prefetchatomslim);
+		prefetchatoms = xrealloc(prefetchatoms,
+				prefetchatomslim * sizeof prefetchatoms[0]);
+	}
+	prefetchatoms[nprefetchatoms++] = atom;
+}
+
+/*
+ * Call function for client messages of type atom sent to a client.
+ */
+void addmsghandler(Atom atom,
+		void (*function)(struct client *, XClientMessageEvent *))
+{
+	struct msghandler *h = xmalloc(sizeof *h);
+	h->function = function;
+	h->next = htfind(&msghandlers, atom);
+	htinsert(&msghandlers, atom, h);
+}
+
+void initclient(void)
+{
+	for (int l = 0; l < NLAYERS; l++)
+		LIST_INIT(&winstack[l]);
+
+	addprefetch(WM_STATE);
+	addprophandler(XA_WM_NAME, reloadwmname);
+	addprophandler(XA_WM_HINTS, reloadwmhints);
+	addprophandler(XA_WM_NORMAL_HINTS, reloadwmnormalhints);
+	addprophandler(XA_WM_TRANSIENT_FOR, reloadwmtransientfor);
+	addprophandler(WM_PROTOCOLS, reloadwmprotocols);
+	addmsghandler(WM_CHANGE_STATE, wmchangestate);
+}
+
 static void cinstallcolormaps(struct client *c)
 {
 	XInstallColormap(dpy, c->colormap == None ?
@@ -809,38 +1598,82 @@ Bool cistask(struct client *c)
 	return !c->skiptaskbar && c->wmtransientfor == None;
 }
 
+/*
+ * Manages a window. Event selection comes first, and THEN all
+ * attributes and properties are read. This avoids losing update
+ * events. The queries are all sent before any reply is waited for,
+ * so this costs a single round trip.
+ */
 struct client *manage(Window window)
+{
+	TRACK(X_ChangeWindowAttributes, window);
+	XSelectInput(dpy, window, CLIENTMASK);
+	prefetch(window, prefetchatoms, nprefetchatoms);
+	prefetchwait();
+
+	struct client *c = manageprefetched(window);
+	prefetchdrop(window);
+	return c;
+}
+
+/*
+ * Manages a window whose attributes and properties have been
+ * prefetched, with events already selected.
+ */
+static struct client *manageprefetched(Window window)
 {
 	XWindowAttributes attr;
-	if (!XGetWindowAttributes(dpy, window, &attr))
-		return NULL;
-	if (attr.override_redirect)
+	if (!getwindowattributes(window, &attr))
 		return NULL;
 
-	long wmstate = getwmstate(window);
-	if (wmstate == WithdrawnState) {
-		XWMHints *h = XGetWMHints(dpy, window);
-		if (h == NULL)
-			wmstate = NormalState;
-		else {
-			if (h->flags & StateHint)
-				wmstate = h->initial_state;
-			else
+	long wmstate = WithdrawnState;
+	if (!attr.override_redirect) {
+		wmstate = getwmstate(window);
+		if (wmstate == WithdrawnState) {
+			XWMHints *h = getwmhints(window);
+			if (h == NULL)
 				wmstate = NormalState;
-			XFree(h);
+			else {
+				if (h->flags & StateHint)
+					wmstate = h->initial_state;
+				else
+					wmstate = NormalState;
+				XFree(h);
+			}
 		}
 	}
-	if (wmstate == WithdrawnState)
+	if (wmstate == WithdrawnState) {
+		TRACK(X_ChangeWindowAttributes, window);
+		XSelectInput(dpy, window, NoEventMask);
 		return NULL;
+	}
 
-	struct client *c = xmalloc(sizeof *c);
+	struct client *c = palloc(&clientpool);
 
+	c->layer = LAYER_NORMAL;
 	LIST_INIT(&c->winstack);
-	LIST_INSERT_TAIL(&winstack, &c->winstack);
+	LIST_INSERT_TAIL(&winstack[c->layer], &c->winstack);
+	nclients++;
 	needrestack = True;
+	stats.restackrequests++;
 
 	c->desk = curdesk;
+	LIST_INIT(&c->deskstack);
+	LIST_INSERT_TAIL(getdesklist(c->desk), &c->deskstack);
+	c->focusstamp = 0;
+	LIST_INIT(&c->deskmru);
+	cinsertmru(c);
+	c->stackwin = None;
+	c->stackpos = 0;
 	c->frame = NULL;
+	LIST_INIT(&c->dirty);
+	c->dirtyatoms = NULL;
+	c->ndirtyatoms = 0;
+	c->dirtyatomslim = 0;
+	c->ownprops = NULL;
+	c->nownprops = 0;
+	c->ownpropslim = 0;
+	c->needsupdate = False;
 	c->wmname = NULL;
 	c->netwmname = NULL;
 	c->wmhints = NULL;
@@ -850,7 +1683,14 @@ struct client *manage(Window window)
 	c->wmtransientfor = None;
 
 	c->window = window;
-	c->app = window;
+	htinsert(&clients, window, c);
+	c->appmember.client = c;
+	c->appmember.group = NULL;
+	LIST_INIT(&c->appmember.node);
+	c->transmember.client = c;
+	c->transmember.group = NULL;
+	LIST_INIT(&c->transmember.node);
+	csetapp(c, window);
 	c->colormap = attr.colormap;
 
 	c->ignoreunmapcount = 0;
@@ -858,11 +1698,14 @@ struct client *manage(Window window)
 	c->hasfocus = False;
 	c->isfull = False;
 	c->isdock = False;
+	c->isabove = False;
+	c->isbelow = False;
 	c->skiptaskbar = False;
 	c->isundecorated = False;
 	c->followdesk = False;
 	c->initialized = False;
 
+	c->slot = newslot(c);
 	csetgeom(c, (struct geometry){
 			attr.x,
 			attr.y,
@@ -870,46 +1713,15 @@ struct client *manage(Window window)
 			attr.height,
 			attr.border_width });
 
+	c->ismapped = attr.map_state != IsUnmapped;
+
+	TRACK(X_ChangeSaveSet, c->window);
 	XAddToSaveSet(dpy, c->window);
 
-	/*
-	 * Everything initialized to default values. Register
-	 * for events and THEN (re)load all attributes and
-	 * properties. This avoids losing update events.
-	 */
 	c->listener.function = event;
 	c->listener.pointer = c;
+	c->listener.name = "client";
 	setlistener(c->window, &c->listener);
-	XSelectInput(dpy, c->window,
-			StructureNotifyMask |
-			PropertyChangeMask |
-			ColormapChangeMask |
-			FocusChangeMask);
-
-	XSync(dpy, False);
-
-	/*
-	 * Done registering for events. What we read now is
-	 * safe to use, since any updates will be notified
-	 * to our event listener.
-	 */
-
-	c->ismapped = ismapped(c->window);
-
-	if (!XGetWindowAttributes(dpy, c->window, &attr)) {
-		// The window disappeared.
-		crelease(c, True);
-		return NULL;
-	}
-
-	csetgeom(c, (struct geometry){
-			attr.x,
-			attr.y,
-			attr.width,
-			attr.height,
-			attr.border_width });
-
-	c->colormap = attr.colormap;
 
 	reloadwmname(c);
 	reloadwmhints(c);
@@ -955,6 +1767,10 @@ struct client *manage(Window window)
 
 	c->initialized = True;
 
+	/*
+	 * At startup, manageall maps the clients after it has
+	 * restacked them all.
+	 */
 	if (wmstate == IconicState && runlevel == RL_NORMAL) {
 		// Closest thing to iconic state
 		cpush(c);
@@ -966,7 +1782,7 @@ struct client *manage(Window window)
 			XBell(dpy, 0);
 			gotodesk(c->desk);
 		}
-		if (cisvisible(c)) {
+		if (cisvisible(c) && runlevel != RL_STARTUP) {
 			cmap(c);
 			if (runlevel == RL_NORMAL)
 				cfocus(c, CurrentTime);
@@ -976,6 +1792,15 @@ struct client *manage(Window window)
 	return c;
 }
 
+/*
+ * Adopts the existing top-level windows in three steps. First the
+ * attributes and WM_STATE of all windows are queried at once, to
+ * find those to manage: mapped ones, and ones iconified by the
+ * previous window manager. Then events are selected on those and
+ * everything manage reads is prefetched for all of them at once,
+ * before the clients are created. Finally they are restacked once,
+ * and then mapped, so that mapping doesn't restack for each one.
+ */
 void manageall(void)
 {
 	assert(stacktop == None);
@@ -983,15 +1808,55 @@ void manageall(void)
 			InputOnly, CopyFromParent, 0, NULL);
 	Window r, p, *stack;
 	unsigned n;
-	if (XQueryTree(dpy, root, &r, &p, &stack, &n) != 0) {
-		for (int i = 0; i < n; i++) {
-			if (ismapped(stack[i]))
-				manage(stack[i]);
-		}
-		if (stack != NULL)
-			XFree(stack);
+	if (XQueryTree(dpy, root, &r, &p, &stack, &n) == 0) {
+		stack = NULL;
+		n = 0;
+	}
+	stats.startupwindows = n;
+
+	unsigned long t = usecs();
+	for (int i = 0; i < n; i++)
+		prefetch(stack[i], &WM_STATE, 1);
+	prefetchwait();
+	int m = 0;
+	for (int i = 0; i < n; i++) {
+		XWindowAttributes a;
+		Bool adopt = getwindowattributes(stack[i], &a) &&
+				!a.override_redirect &&
+				(a.map_state != IsUnmapped ||
+				getwmstate(stack[i]) == IconicState);
+		prefetchdrop(stack[i]);
+		if (adopt)
+			stack[m++] = stack[i];
+	}
+	stats.startupquery = usecs() - t;
+
+	t = usecs();
+	for (int i = 0; i < m; i++) {
+		TRACK(X_ChangeWindowAttributes, stack[i]);
+		XSelectInput(dpy, stack[i], CLIENTMASK);
+		prefetch(stack[i], prefetchatoms, nprefetchatoms);
+	}
+	prefetchwait();
+	int k = 0;
+	for (int i = 0; i < m; i++) {
+		if (manageprefetched(stack[i]) != NULL)
+			stack[k++] = stack[i];
+		prefetchdrop(stack[i]);
 	}
+	stats.startupadopted = k;
+	stats.startupmanage = usecs() - t;
+
+	t = usecs();
 	restack();
+	for (int i = 0; i < k; i++) {
+		struct client *c = htfind(&clients, stack[i]);
+		if (c != NULL && cisvisible(c))
+			cmap(c);
+	}
+	if (stack != NULL)
+		XFree(stack);
+	stats.startuprestack = usecs() - t;
 }
 
 static void cmap(struct client *c)
@@ -1014,8 +1879,10 @@ static void cmap(struct client *c)
 			Window f = fgetwin(c->frame);
 			XMapSubwindows(dpy, f);
 			XMapWindow(dpy, f);
-		} else
+		} else {
+			TRACK(X_MapWindow, c->window);
 			XMapWindow(dpy, c->window);
+		}
 		c->ismapped = True;
 	}
 }
@@ -1028,8 +1895,10 @@ static void cunmap(struct client *c)
 			Window f = fgetwin(c->frame);
 			XUnmapWindow(dpy, f);
 			XUnmapSubwindows(dpy, f);
-		} else
+		} else {
+			TRACK(X_UnmapWindow, c->window);
 			XUnmapWindow(dpy, c->window);
+		}
 		c->ignoreunmapcount++;
 		c->ismapped = False;
 	}
@@ -1039,6 +1908,8 @@ static void crelease(struct client *c, Bool clientrequested)
 {
 	// Unset this or fdestroy() will refocus the window.
 	c->hasfocus = False;
+	if (focus == c)
+		focus = NULL;
 
 	if (c->frame != NULL) {
 		fdestroy(c->frame);
@@ -1046,10 +1917,24 @@ static void crelease(struct client *c, Bool clientrequested)
 	}
 
 	LIST_REMOVE(&c->winstack);
+	nclients--;
+	LIST_REMOVE(&c->deskstack);
+	LIST_REMOVE(&c->deskmru);
+	leavegroup(&apps, &c->appmember);
+	leavegroup(&transients, &c->transmember);
+	htremove(&clients, c->window);
+	cupdatetransientlayers(c->window);
+	prefetchdrop(c->window);
+	freeslot(c->slot);
 	needrestack = True;
+	stats.restackrequests++;
+
+	if (LIST_MEMBER(&c->dirty))
+		LIST_REMOVE(&c->dirty);
 
 	ungrabkey(AnyKey, AnyModifier, c->window);
 
+	TRACK(X_ChangeWindowAttributes, c->window);
 	XSelectInput(dpy, c->window, 0);
 	setlistener(c->window, NULL);
 	if (!clientrequested)
@@ -1064,7 +1949,9 @@ static void crelease(struct client *c, Bool clientrequested)
 		XFree(c->wmprotocols);
 	free(c->wmname);
 	free(c->netwmname);
-	free(c);
+	free(c->dirtyatoms);
+	free(c->ownprops);
+	pfree(&clientpool, c);
 
 	if (getfocus() == NULL)
 		refocus(CurrentTime);
@@ -1097,7 +1984,7 @@ void unmanageall(void)
 	getclientstack(&v, &n);
 	for (int i = n - 1; i >= 0; i--)
 		cunmanage(v[i]);
-	free(v);
+	putclientstack(v);
 
 	if (stacktop != None) {
 		XDestroyWindow(dpy, stacktop);
@@ -1107,53 +1994,62 @@ void unmanageall(void)
 
 struct client *getfocus(void)
 {
-	List *lp;
-	LIST_FOREACH_REV(lp, &winstack) {
-		struct client *c = LIST_ITEM(lp, struct client, winstack);
-		if (c->hasfocus) {
-			assert(c->desk == curdesk || c->desk == DESK_ALL);
-			assert(c->ismapped);
-			return c;
-		}
+	if (focus != NULL) {
+		assert(focus->hasfocus);
+		assert(focus->desk == curdesk || focus->desk == DESK_ALL);
+		assert(focus->ismapped);
 	}
-	return NULL;
+	return focus;
 }
 
+/*
+ * Return the task to focus on the current desk: the most recently
+ * focused task of the desk or the sticky tasks, or else the top one.
+ */
 static struct client *getfronttask(void)
 {
+	struct client *c = getmrutask(&getdesk(curdesk)->mru);
+	struct client *s = getmrutask(&sticky.mru);
+	if (c == NULL || (s != NULL && s->focusstamp > c->focusstamp))
+		c = s;
+	if (c != NULL)
+		return c;
+
 	List *lp;
-	LIST_FOREACH_REV(lp, &winstack) {
-		struct client *c = LIST_ITEM(lp, struct client, winstack);
-		if (cisvisible(c) && cistask(c))
-			return c;
-	}
+	for (int l = NLAYERS - 1; l >= 0; l--)
+		LIST_FOREACH_REV(lp, &winstack[l]) {
+			struct client *x = LIST_ITEM(lp, struct client,
+					winstack);
+			if (cisvisible(x) && cistask(x))
+				return x;
+		}
 	return NULL;
 }
 
 static void cfocusapp(struct client *c, Time time)
 {
 	struct client *topmost = NULL;
-	struct client *focus = NULL;
+	struct client *target = NULL;
 
 	// Find a window of the application that expects focus.
+	List *g = getgroup(&apps, c->app);
 	List *lp;
-	LIST_FOREACH_REV(lp, &winstack) {
-		struct client *x = LIST_ITEM(
-				lp, struct client, winstack);
-		if (x->app == c->app && cisvisible(x)) {
+	LIST_FOREACH_REV(lp, g) {
+		struct client *x = LIST_ITEM(lp, struct member, node)->client;
+		if (cisvisible(x)) {
 			if (topmost == NULL)
 				topmost = x;
-			if (focus == NULL && expectsfocus(x))
-				focus = x;
+			if (target == NULL && expectsfocus(x))
+				target = x;
 		}
 	}
 
-	if (focus == NULL)
-		focus = topmost;
+	if (target == NULL)
+		target = topmost;
 
-	assert(focus != NULL);
+	assert(target != NULL);
 
-	cfocus(focus, time);
+	cfocus(target, time);
 }
 
 /*
@@ -1167,6 +2063,7 @@ void cfocus(struct client *c, Time time)
 	if (!cismapped(c))
 		return;
 
+	TRACK(X_SetInputFocus, c->window);
 	XSetInputFocus(dpy, c->window, RevertToPointerRoot, time);
 }
 
@@ -1220,6 +2117,7 @@ static void csendwmproto(struct client *c, Atom protocol, Time time)
 	e.xclient.data.l[0] = protocol;
 	e.xclient.data.l[1] = time;
 
+	TRACK(X_SendEvent, c->window);
 	XSendEvent(dpy, c->window, False, 0L, &e);
 }
 
@@ -1248,6 +2146,69 @@ struct geometry cgetgeom(struct client *c)
 void csetgeom(struct client *c, struct geometry g)
 {
 	c->geometry = g;
+	cupdaterect(c);
+}
+
+/*
+ * Allocate a slot in the rectangle store.
+ */
+static int newslot(struct client *c)
+{
+	int i;
+	if (rects.nfree > 0)
+		i = rects.free[--rects.nfree];
+	else {
+		if (rects.n == rects.lim) {
+			rects.lim = MAX(32, 2 * rects.lim);
+			rects.x = xrealloc(rects.x,
+					rects.lim * sizeof rects.x[0]);
+			rects.y = xrealloc(rects.y,
+					rects.lim * sizeof rects.y[0]);
+			rects.width = xrealloc(rects.width,
+					rects.lim * sizeof rects.width[0]);
+			rects.height = xrealloc(rects.height,
+					rects.lim * sizeof rects.height[0]);
+			rects.desk = xrealloc(rects.desk,
+					rects.lim * sizeof rects.desk[0]);
+			rects.owner = xrealloc(rects.owner,
+					rects.lim * sizeof rects.owner[0]);
+			rects.free = xrealloc(rects.free,
+					rects.lim * sizeof rects.free[0]);
+		}
+		i = rects.n++;
+	}
+	rects.owner[i] = c;
+	rects.desk[i] = c->desk;
+	rects.x[i] = rects.y[i] = rects.width[i] = rects.height[i] = 0;
+	return i;
+}
+
+static void freeslot(int i)
+{
+	rects.owner[i] = NULL;
+	rects.free[rects.nfree++] = i;
+}
+
+/*
+ * Store the outer rectangle of the client, which is that of its
+ * frame if it has one.
+ */
+static void cupdaterect(struct client *c)
+{
+	int i = c->slot;
+	if (c->frame != NULL) {
+		struct extents e = estimateframeextents(c->window);
+		rects.x[i] = c->geometry.x - e.left;
+		rects.y[i] = c->geometry.y - e.top;
+		rects.width[i] = c->geometry.width + e.left + e.right;
+		rects.height[i] = c->geometry.height + e.top + e.bottom;
+	} else {
+		struct geometry g = cgetgeom(c);
+		rects.x[i] = g.x;
+		rects.y[i] = g.y;
+		rects.width[i] = g.width + 2 * g.borderwidth;
+		rects.height[i] = g.height + 2 * g.borderwidth;
+	}
 }
 
 void chintsize(struct client *c, int width, int height,
@@ -1329,6 +2290,7 @@ void chintsize(struct client *c, int width, int height,
 void csendconf(struct client *c)
 {
 	struct geometry g = cgetgeom(c);
+	TRACK(X_SendEvent, c->window);
 	XSendEvent(dpy, c->window, False, StructureNotifyMask,
 			(XEvent *)&(XConfigureEvent){
 				.type = ConfigureNotify,
@@ -1358,8 +2320,7 @@ void csetnetwmname(struct client *c, const char *name)
 	free(c->netwmname);
 	c->netwmname = (name == NULL) ? NULL : xstrdup(name);
 
-	if (c->frame != NULL)
-		fupdate(c->frame);
+	cupdateframe(c);
 }
 
 void cignoreunmap(struct client *c)
@@ -1381,12 +2342,16 @@ Bool cisurgent(struct client *c)
 static void creframe(struct client *c)
 {
 	if (cisframed(c)) {
-		if (c->frame == NULL)
+		if (c->frame == NULL) {
 			c->frame = fcreate(c);
+			c->stackwin = None;
+		}
 	} else if (c->frame != NULL) {
 		fdestroy(c->frame);
 		c->frame = NULL;
+		c->stackwin = None;
 	}
+	cupdaterect(c);
 }
 
 static Bool cisframed(struct client *c)
@@ -1416,15 +2381,6 @@ static void smartpos(struct client *c)
 	struct geometry g = c->frame == NULL ?
 			cgetgeom(c) : fgetgeom(c->frame);
 
-	struct client **v;
-	int n;
-	getclientstack(&v, &n);
-
-	// Exclude the window itself, and clients on other desks
-	for (int i = 0; i < n; i++)
-		if (v[i] == c || !samedesk(v[i], c))
-			v[i--] = v[--n];
-
 	unsigned long min = ~0;
 	struct geometry best = g;
 	for (int k = 0; min != 0 && k < 100; k++) {
@@ -1432,10 +2388,20 @@ static void smartpos(struct client *c)
 		unsigned long badness = 0;
 		unsigned overlaps = 0;
 
-		// Compute overlapping area.
-		for (int i = 0; i < n; i++) {
-			struct geometry g2 = v[i]->frame == NULL ?
-					cgetgeom(v[i]) : fgetgeom(v[i]->frame);
+		// Compute overlapping area with the clients on the same desk.
+		for (int i = 0; i < rects.n; i++) {
+			if (rects.owner[i] == NULL || i == c->slot)
+				continue;
+			if (rects.desk[i] != c->desk &&
+					rects.desk[i] != DESK_ALL &&
+					c->desk != DESK_ALL)
+				continue;
+			struct geometry g2 = {
+				.x = rects.x[i],
+				.y = rects.y[i],
+				.width = rects.width[i],
+				.height = rects.height[i],
+			};
 			unsigned long area = overlaparea(g, g2);
 			if (area > 0) {
 				badness += area;
@@ -1458,8 +2424,6 @@ static void smartpos(struct client *c)
 	}
 
 	move(c, best.x, best.y);
-
-	free(v);
 }
 
 /*
@@ -1473,15 +2437,6 @@ static void randpos(struct geometry *g)
 	g->y = maxy > 0 ? rand() % maxy : 0;
 }
 
-/*
- * Return true if, and only if, the two clients are visible on the same desk.
- */
-static Bool samedesk(struct client *c1, struct client *c2)
-{
-	return c1->desk == c2->desk ||
-			c1->desk == DESK_ALL || c2->desk == DESK_ALL;
-}
-
 static unsigned long overlaparea(struct geometry g1, struct geometry g2)
 {
 	int x1 = g1.x;
@@ -42,12 +42,14 @@ static void event(void *, XEvent *);
 static void buttonpress(struct dragger *, XButtonEvent *);
 static void motionnotify(struct dragger *, XMotionEvent *);
 
+static DEFINE_POOL(draggerpool, struct dragger);
+
 struct dragger *dcreate(Window parent, int x, int y,
 		int width, int height, int gravity, Cursor cursor,
 		void (*dragnotify)(void *, int, int, unsigned long, Time),
 		void *arg)
 {
-	struct dragger *d = xmalloc(sizeof *d);
+	struct dragger *d = palloc(&draggerpool);
 	d->window = XCreateWindow(dpy, parent, x, y, width, height, 0,
 			CopyFromParent, InputOnly, CopyFromParent,
 			CWWinGravity | CWCursor,
@@ -56,6 +58,7 @@ struct dragger *dcreate(Window parent, int x, int y,
 				.cursor = cursor });
 	d->listener.function = event;
 	d->listener.pointer = d;
+	d->listener.name = "dragger";
 	setlistener(d->window, &d->listener);
 	d->counter = 0;
 
@@ -116,7 +119,7 @@ void ddestroy(struct dragger *d)
 {
 	setlistener(d->window, NULL);
 	XDestroyWindow(dpy, d->window);
-	free(d);
+	pfree(&draggerpool, d);
 }
 
 static void event(void *self, XEvent *e)
@@ -145,6 +148,7 @@ static void buttonpress(struct dragger *d, XButtonEvent *e)
 
 static void motionnotify(struct dragger *d, XMotionEvent *e)
 {
+	compressmotion(e);
 	if (d->dragnotify != NULL)
 		d->dragnotify(d->arg,
 				e->x_root - d->x, e->y_root - d->y,
@@ -20,6 +20,7 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,24 +31,35 @@
 
 #define DEFAULT_NUMBER_OF_DESKTOPS 12
 
-#define xatom(name) XInternAtom(dpy, (name), False)
-
 #define NET_WM_STATE_REMOVE 0
 #define NET_WM_STATE_ADD 1
 #define NET_WM_STATE_TOGGLE 2
 
+struct cardprop;
+struct deskprop;
+
 static void addclient(Window);
 static void delclient(Window);
+static void compactclientlist(void);
+static struct deskprop *finddeskprop(Window);
+static struct deskprop *getdeskprop(Window);
+static void deldeskprop(Window);
+static void publishdeskprop(struct deskprop *);
+static void publishndesk(void);
+static void publish(Atom, Atom, struct cardprop *);
 static unsigned long ewmh_getndesktops(void);
-static void setcurrentdesktop(unsigned long);
 static void reloadwindowname(struct client *);
 static void reloadwindowstate(struct client *);
 static void reloadwindowtype(struct client *);
 static void reloadwindowdesktop(struct client *);
-static Bool hasstate(Window, Atom);
-static void removestate(Window, Atom);
-static void addstate(Window, Atom);
-static void changestate(Window, int, Atom);
+static unsigned getstates(struct client *);
+static void setstates(struct client *, unsigned);
+static void publishstates(struct client *, unsigned);
+static void applystates(struct client *, unsigned);
+static void activatewindow(struct client *, XClientMessageEvent *);
+static void closewindow(struct client *, XClientMessageEvent *);
+static void setwindowdesktop(struct client *, XClientMessageEvent *);
+static void setwindowstate(struct client *, XClientMessageEvent *);
 
 /*
  * The list of supported properties. Note that we need to
@@ -92,22 +104,147 @@ static Atom NET_WORKAREA;
 
 static Atom UTF8_STRING;
 
+/*
+ * The atoms of the supported properties above, other than the
+ * states, and the supported states in the order of their enum,
+ * so that atomindex maps a state atom to it.
+ *
+ * NB: Keep both lists sorted by name. They are merged in that
+ * order into _NET_SUPPORTED.
+ */
+static const struct atomdef netatoms[] = {
+	{ &NET_ACTIVE_WINDOW, "_NET_ACTIVE_WINDOW" },
+	{ &NET_CLIENT_LIST, "_NET_CLIENT_LIST" },
+	{ &NET_CLIENT_LIST_STACKING, "_NET_CLIENT_LIST_STACKING" },
+	{ &NET_CLOSE_WINDOW, "_NET_CLOSE_WINDOW" },
+	{ &NET_CURRENT_DESKTOP, "_NET_CURRENT_DESKTOP" },
+	{ &NET_DESKTOP_GEOMETRY, "_NET_DESKTOP_GEOMETRY" },
+	{ &NET_DESKTOP_VIEWPORT, "_NET_DESKTOP_VIEWPORT" },
+	{ &NET_FRAME_EXTENTS, "_NET_FRAME_EXTENTS" },
+	{ &NET_NUMBER_OF_DESKTOPS, "_NET_NUMBER_OF_DESKTOPS" },
+	{ &NET_REQUEST_FRAME_EXTENTS, "_NET_REQUEST_FRAME_EXTENTS" },
+	{ &NET_SUPPORTED, "_NET_SUPPORTED" },
+	{ &NET_SUPPORTING_WM_CHECK, "_NET_SUPPORTING_WM_CHECK" },
+	{ &NET_WM_ACTION_CHANGE_DESKTOP, "_NET_WM_ACTION_CHANGE_DESKTOP" },
+	{ &NET_WM_ACTION_CLOSE, "_NET_WM_ACTION_CLOSE" },
+	{ &NET_WM_ACTION_FULLSCREEN, "_NET_WM_ACTION_FULLSCREEN" },
+	{ &NET_WM_ACTION_MINIMIZE, "_NET_WM_ACTION_MINIMIZE" },
+	{ &NET_WM_ALLOWED_ACTIONS, "_NET_WM_ALLOWED_ACTIONS" },
+	{ &NET_WM_DESKTOP, "_NET_WM_DESKTOP" },
+	{ &NET_WM_ICON_NAME, "_NET_WM_ICON_NAME" },
+	{ &NET_WM_NAME, "_NET_WM_NAME" },
+	{ &NET_WM_STATE, "_NET_WM_STATE" },
+	{ &NET_WM_VISIBLE_ICON_NAME, "_NET_WM_VISIBLE_ICON_NAME" },
+	{ &NET_WM_VISIBLE_NAME, "_NET_WM_VISIBLE_NAME" },
+	{ &NET_WM_WINDOW_TYPE, "_NET_WM_WINDOW_TYPE" },
+	{ &NET_WM_WINDOW_TYPE_DOCK, "_NET_WM_WINDOW_TYPE_DOCK" },
+	{ &NET_WORKAREA, "_NET_WORKAREA" },
+};
+
+enum {
+	STATE_ABOVE,
+	STATE_BELOW,
+	STATE_FULLSCREEN,
+	STATE_HIDDEN,
+	STATE_SKIP_TASKBAR
+};
+
+static const struct atomdef stateatoms[] = {
+	{ &NET_WM_STATE_ABOVE, "_NET_WM_STATE_ABOVE" },
+	{ &NET_WM_STATE_BELOW, "_NET_WM_STATE_BELOW" },
+	{ &NET_WM_STATE_FULLSCREEN, "_NET_WM_STATE_FULLSCREEN" },
+	{ &NET_WM_STATE_HIDDEN, "_NET_WM_STATE_HIDDEN" },
+	{ &NET_WM_STATE_SKIP_TASKBAR, "_NET_WM_STATE_SKIP_TASKBAR" },
+};
+
+static const struct atomdef otheratoms[] = {
+	{ &UTF8_STRING, "UTF8_STRING" },
+};
+
 static Window wmcheckwin = None;
 
+/*
+ * The _NET_WM_STATE of each client as a set of STATEBIT values,
+ * plus one. The property is written from this and only read back
+ * when the client changes it.
+ */
+static struct hashtab windowstates;
+#define STATEBIT(s) (1U << (s))
+
+/*
+ * _NET_CLIENT_LIST, in the order the clients were managed.
+ * Removed clients leave a None entry behind until the list is
+ * compacted on the next write. The index is one more than the
+ * position of each window in the list.
+ */
+static struct {
+	Window *v;
+	size_t n;
+	size_t lim;
+	size_t published;	// leading entries written to the property
+	Bool removed;		// None entries need to be compacted
+	struct hashtab index;
+} clientlist;
+
+/*
+ * The properties below are not written when they change, but
+ * by ewmh_flush, which is called once per event batch. Each
+ * property is written only if its value differs from the value
+ * last written, so a burst of changes costs at most one write
+ * per property.
+ */
+struct cardprop {
+	unsigned long value;
+	unsigned long published;
+	Bool ispublished;
+};
+
+static struct cardprop ndesktops;
+static struct cardprop curdesktop;
+static struct cardprop activewindow;
+
+static Bool clientlistdirty = False;
+static Bool stackingdirty = False;
+
+// The last written _NET_CLIENT_LIST_STACKING
 static struct {
 	Window *v;
 	size_t n;
 	size_t lim;
-} clientlist = { NULL, 0, 0 };
+	Bool ispublished;
+} stacking;
+
+/*
+ * _NET_WM_DESKTOP of client windows. The index is one more than
+ * the position of each window's record in the array.
+ */
+struct deskprop {
+	Window window;
+	unsigned long desk;
+	unsigned long published;
+	Bool ispublished;
+};
+
+static struct {
+	struct deskprop *v;
+	size_t n;
+	size_t lim;
+	Bool dirty;
+	struct hashtab index;
+} deskprops;
 
 void ewmh_notifyclientdesktop(Window w, unsigned long i)
 {
-	setprop(w, NET_WM_DESKTOP, XA_CARDINAL, 32, &i, 1);
+	struct deskprop *p = getdeskprop(w);
+	p->desk = i;
+	deskprops.dirty = True;
+	stats.ewmhupdates++;
 }
 
 void ewmh_notifycurdesk(unsigned long n)
 {
-	setprop(root, NET_CURRENT_DESKTOP, XA_CARDINAL, 32, &n, 1);
+	curdesktop.value = n;
+	stats.ewmhupdates++;
 }
 
 void ewmh_notifyframeextents(Window w, struct extents e)
@@ -119,50 +256,119 @@ void ewmh_notifyframeextents(Window w, struct extents e)
 static void addclient(Window w)
 {
 	if (clientlist.n == clientlist.lim) {
-		clientlist.lim += 32;
+		clientlist.lim = MAX(32, 2 * clientlist.lim);
 		clientlist.v = xrealloc(clientlist.v,
 			clientlist.lim * sizeof clientlist.v[0]);
 	}
 	clientlist.v[clientlist.n++] = w;
-	setprop(root, NET_CLIENT_LIST, XA_WINDOW, 32,
-			clientlist.v, clientlist.n);
+	htinsert(&clientlist.index, w, (void *)(uintptr_t)clientlist.n);
+	clientlistdirty = True;
+	stats.ewmhupdates++;
 }
 
 static void delclient(Window w)
 {
-	int i;
-	for (i = 0; i < clientlist.n && clientlist.v[i] != w; i++)
-		;
-	if (i < clientlist.n) {
-		for (; i < clientlist.n - 1; i++)
-			clientlist.v[i] = clientlist.v[i + 1];
-		clientlist.n--;
+	uintptr_t i = (uintptr_t)htfind(&clientlist.index, w);
+	if (i != 0) {
+		htremove(&clientlist.index, w);
+		clientlist.v[i - 1] = None;
+		clientlist.removed = True;
 	}
-	setprop(root, NET_CLIENT_LIST, XA_WINDOW, 32,
-			clientlist.v, clientlist.n);
-	if (clientlist.n == 0) {
-		free(clientlist.v);
-		clientlist.v = NULL;
-		clientlist.lim = 0;
+	clientlistdirty = True;
+	stats.ewmhupdates++;
+}
+
+/*
+ * Remove the None entries left by removed clients.
+ */
+static void compactclientlist(void)
+{
+	size_t k = 0;
+	for (size_t i = 0; i < clientlist.n; i++)
+		if (clientlist.v[i] != None) {
+			if (k != i) {
+				clientlist.v[k] = clientlist.v[i];
+				htinsert(&clientlist.index, clientlist.v[k],
+						(void *)(uintptr_t)(k + 1));
+			}
+			k++;
+		}
+	clientlist.n = k;
+	clientlist.removed = False;
+}
+
+/*
+ * Return the _NET_WM_DESKTOP record of a client window,
+ * or NULL if it doesn't exist.
+ */
+static struct deskprop *finddeskprop(Window w)
+{
+	uintptr_t i = (uintptr_t)htfind(&deskprops.index, w);
+	return i == 0 ? NULL : &deskprops.v[i - 1];
+}
+
+/*
+ * Return the _NET_WM_DESKTOP record of a client window,
+ * creating an unpublished one if it doesn't exist.
+ */
+static struct deskprop *getdeskprop(Window w)
+{
+	struct deskprop *p = finddeskprop(w);
+	if (p != NULL)
+		return p;
+
+	if (deskprops.n == deskprops.lim) {
+		deskprops.lim += 32;
+		deskprops.v = xrealloc(deskprops.v,
+			deskprops.lim * sizeof deskprops.v[0]);
 	}
+	p = &deskprops.v[deskprops.n++];
+	htinsert(&deskprops.index, w, (void *)(uintptr_t)deskprops.n);
+	p->window = w;
+	p->desk = 0;
+	p->published = 0;
+	p->ispublished = False;
+	return p;
 }
 
-static unsigned long ewmh_getndesktops(void)
+/*
+ * Forget the _NET_WM_DESKTOP record of a client window,
+ * without publishing any pending change.
+ */
+static void deldeskprop(Window w)
 {
-	unsigned long ndesk = DEFAULT_NUMBER_OF_DESKTOPS;
-	unsigned long n;
-	unsigned long *p = getprop(root, NET_NUMBER_OF_DESKTOPS, XA_CARDINAL,
-			32, &n);
-	if (p != NULL) {
-		if (n == 1)
-			ndesk = *p & 0xffffffffUL;
-		XFree(p);
+	uintptr_t i = (uintptr_t)htfind(&deskprops.index, w);
+	if (i == 0)
+		return;
+	htremove(&deskprops.index, w);
+	deskprops.v[i - 1] = deskprops.v[--deskprops.n];
+	if (i - 1 < deskprops.n)
+		htinsert(&deskprops.index, deskprops.v[i - 1].window,
+				(void *)i);
+	if (deskprops.n == 0) {
+		free(deskprops.v);
+		deskprops.v = NULL;
+		deskprops.lim = 0;
 	}
-	return ndesk;
 }
 
-void ewmh_notifyndesk(unsigned long n)
+static void publishdeskprop(struct deskprop *p)
 {
+	if (!p->ispublished || p->desk != p->published) {
+		setprop(p->window, NET_WM_DESKTOP, XA_CARDINAL, 32,
+				&p->desk, 1);
+		p->published = p->desk;
+		p->ispublished = True;
+		stats.ewmhwrites++;
+	}
+}
+
+static void publishndesk(void)
+{
+	if (ndesktops.ispublished && ndesktops.value == ndesktops.published)
+		return;
+
+	unsigned long n = ndesktops.value;
 	long *viewport = xmalloc(n * 2 * sizeof (long));
 	long *workarea = xmalloc(n * 4 * sizeof (long));
 	for (unsigned long i = 0; i < n; i++) {
@@ -179,56 +385,144 @@ void ewmh_notifyndesk(unsigned long n)
 	free(workarea);
 	free(viewport);
 
-	setprop(root, NET_NUMBER_OF_DESKTOPS, XA_CARDINAL, 32, &n, 1);
+	publish(NET_NUMBER_OF_DESKTOPS, XA_CARDINAL, &ndesktops);
 }
 
-static void setcurrentdesktop(unsigned long i)
+static void publish(Atom prop, Atom type, struct cardprop *p)
 {
-	setprop(root, NET_CURRENT_DESKTOP, XA_CARDINAL, 32, &i, 1);
+	if (!p->ispublished || p->value != p->published) {
+		setprop(root, prop, type, 32, &p->value, 1);
+		p->published = p->value;
+		p->ispublished = True;
+		stats.ewmhwrites++;
+	}
 }
 
-void ewmh_startwm(void)
+/*
+ * Write all root and client window properties that
+ * have changed since they were last written.
+ */
+void ewmh_flush(void)
 {
-	UTF8_STRING = xatom("UTF8_STRING");
+	/*
+	 * Make sure the current desktop is never published
+	 * out of range while the number of desktops changes.
+	 */
+	Bool shrink = ndesktops.ispublished &&
+			ndesktops.value < ndesktops.published;
+	if (!shrink)
+		publishndesk();
+	publish(NET_CURRENT_DESKTOP, XA_CARDINAL, &curdesktop);
+	if (shrink)
+		publishndesk();
+
+	publish(NET_ACTIVE_WINDOW, XA_WINDOW, &activewindow);
+
+	if (clientlistdirty) {
+		/*
+		 * New clients are appended to the property. It is
+		 * rewritten as a whole only if clients were removed,
+		 * or nothing was written yet.
+		 */
+		Bool rewrite = clientlist.removed || clientlist.published == 0;
+		if (clientlist.removed)
+			compactclientlist();
+		if (rewrite)
+			setprop(root, NET_CLIENT_LIST, XA_WINDOW, 32,
+					clientlist.v, clientlist.n);
+		else
+			appendprop(root, NET_CLIENT_LIST, XA_WINDOW, 32,
+					clientlist.v + clientlist.published,
+					clientlist.n - clientlist.published);
+		clientlist.published = clientlist.n;
+		clientlistdirty = False;
+		stats.ewmhwrites++;
+		if (clientlist.n == 0) {
+			free(clientlist.v);
+			clientlist.v = NULL;
+			clientlist.lim = 0;
+		}
+	}
 
-	Atom v[] = {
-		// Keep sorted
-		NET_ACTIVE_WINDOW = xatom("_NET_ACTIVE_WINDOW"),
-		NET_CLIENT_LIST = xatom("_NET_CLIENT_LIST"),
-		NET_CLIENT_LIST_STACKING = xatom("_NET_CLIENT_LIST_STACKING"),
-		NET_CLOSE_WINDOW = xatom("_NET_CLOSE_WINDOW"),
-		NET_CURRENT_DESKTOP = xatom("_NET_CURRENT_DESKTOP"),
-		NET_DESKTOP_GEOMETRY = xatom("_NET_DESKTOP_GEOMETRY"),
-		NET_DESKTOP_VIEWPORT = xatom("_NET_DESKTOP_VIEWPORT"),
-		NET_FRAME_EXTENTS = xatom("_NET_FRAME_EXTENTS"),
-		NET_NUMBER_OF_DESKTOPS = xatom("_NET_NUMBER_OF_DESKTOPS"),
-		NET_REQUEST_FRAME_EXTENTS =
-			xatom("_NET_REQUEST_FRAME_EXTENTS"),
-		NET_SUPPORTED = xatom("_NET_SUPPORTED"),
-		NET_SUPPORTING_WM_CHECK = xatom("_NET_SUPPORTING_WM_CHECK"),
-		NET_WM_ACTION_CHANGE_DESKTOP =
-			xatom("_NET_WM_ACTION_CHANGE_DESKTOP"),
-		NET_WM_ACTION_CLOSE = xatom("_NET_WM_ACTION_CLOSE"),
-		NET_WM_ACTION_FULLSCREEN = xatom("_NET_WM_ACTION_FULLSCREEN"),
-		NET_WM_ACTION_MINIMIZE = xatom("_NET_WM_ACTION_MINIMIZE"),
-		NET_WM_ALLOWED_ACTIONS = xatom("_NET_WM_ALLOWED_ACTIONS"),
-		NET_WM_DESKTOP = xatom("_NET_WM_DESKTOP"),
-		NET_WM_ICON_NAME = xatom("_NET_WM_ICON_NAME"),
-		NET_WM_NAME = xatom("_NET_WM_NAME"),
-		NET_WM_STATE = xatom("_NET_WM_STATE"),
-		NET_WM_STATE_ABOVE = xatom("_NET_WM_STATE_ABOVE"),
-		NET_WM_STATE_BELOW = xatom("_NET_WM_STATE_BELOW"),
-		NET_WM_STATE_FULLSCREEN = xatom("_NET_WM_STATE_FULLSCREEN"),
-		NET_WM_STATE_HIDDEN = xatom("_NET_WM_STATE_HIDDEN"),
-		NET_WM_STATE_SKIP_TASKBAR =
-			xatom("_NET_WM_STATE_SKIP_TASKBAR"),
-		NET_WM_VISIBLE_ICON_NAME = xatom("_NET_WM_VISIBLE_ICON_NAME"),
-		NET_WM_VISIBLE_NAME = xatom("_NET_WM_VISIBLE_NAME"),
-		NET_WM_WINDOW_TYPE = xatom("_NET_WM_WINDOW_TYPE"),
-		NET_WM_WINDOW_TYPE_DOCK = xatom("_NET_WM_WINDOW_TYPE_DOCK"),
-		NET_WORKAREA = xatom("_NET_WORKAREA"),
-	};
-	setprop(root, NET_SUPPORTED, XA_ATOM, 32, v, NELEM(v));
+	if (stackingdirty) {
+		Window *v;
+		size_t n;
+		getwindowstack(&v, &n);
+		if (stacking.ispublished && n == stacking.n &&
+				memcmp(v, stacking.v, n * sizeof v[0]) == 0)
+			stats.stackingskipped++;
+		else {
+			setprop(root, NET_CLIENT_LIST_STACKING, XA_WINDOW, 32,
+					v, n);
+			if (n > stacking.lim) {
+				stacking.lim = MAX(n, 2 * stacking.lim);
+				stacking.v = xrealloc(stacking.v,
+					stacking.lim * sizeof stacking.v[0]);
+			}
+			memcpy(stacking.v, v, n * sizeof v[0]);
+			stacking.n = n;
+			stacking.ispublished = True;
+			stats.stackingwritten++;
+			stats.ewmhwrites++;
+		}
+		stackingdirty = False;
+	}
+
+	if (deskprops.dirty) {
+		for (size_t i = 0; i < deskprops.n; i++)
+			publishdeskprop(&deskprops.v[i]);
+		deskprops.dirty = False;
+	}
+}
+
+static unsigned long ewmh_getndesktops(void)
+{
+	unsigned long ndesk = DEFAULT_NUMBER_OF_DESKTOPS;
+	unsigned long n;
+	unsigned long *p = getprop(root, NET_NUMBER_OF_DESKTOPS, XA_CARDINAL,
+			32, &n);
+	if (p != NULL) {
+		if (n == 1)
+			ndesk = *p & 0xffffffffUL;
+		XFree(p);
+	}
+	return ndesk;
+}
+
+void ewmh_notifyndesk(unsigned long n)
+{
+	ndesktops.value = n;
+	stats.ewmhupdates++;
+}
+
+void ewmh_declareatoms(void)
+{
+	declareatoms(netatoms, NELEM(netatoms));
+	declareatoms(stateatoms, NELEM(stateatoms));
+	declareatoms(otheratoms, NELEM(otheratoms));
+}
+
+void ewmh_startwm(void)
+{
+	Atom v[NELEM(netatoms) + NELEM(stateatoms)];
+	int nv = 0;
+	for (int i = 0, k = 0; i < NELEM(netatoms) || k < NELEM(stateatoms); )
+		if (k == NELEM(stateatoms) || (i < NELEM(netatoms) &&
+				strcmp(netatoms[i].name,
+				stateatoms[k].name) < 0))
+			v[nv++] = *netatoms[i++].atom;
+		else
+			v[nv++] = *stateatoms[k++].atom;
+	setprop(root, NET_SUPPORTED, XA_ATOM, 32, v, nv);
+
+	addprophandler(NET_WM_NAME, reloadwindowname);
+	addprefetch(NET_WM_DESKTOP);
+	addprophandler(NET_WM_STATE, reloadwindowstate);
+	addprefetch(NET_WM_WINDOW_TYPE);
+	addmsghandler(NET_ACTIVE_WINDOW, activatewindow);
+	addmsghandler(NET_CLOSE_WINDOW, closewindow);
+	addmsghandler(NET_WM_DESKTOP, setwindowdesktop);
+	addmsghandler(NET_WM_STATE, setwindowstate);
 
 	long geometry[2] = { DisplayWidth(dpy, scr), DisplayHeight(dpy, scr) };
 	setprop(root, NET_DESKTOP_GEOMETRY, XA_CARDINAL, 32, geometry, 2);
@@ -238,7 +532,7 @@ void ewmh_startwm(void)
 	unsigned long n = 0;
 	unsigned long *deskp = getprop(root, NET_CURRENT_DESKTOP,
 			XA_CARDINAL, 32, &n);
-	setcurrentdesktop(0);
+	ewmh_notifycurdesk(0);
 	if (deskp != NULL) {
 		if (n == 1) {
 			gotodesk(*deskp & 0xffffffffUL);
@@ -247,8 +541,7 @@ void ewmh_startwm(void)
 		XFree(deskp);
 	}
 
-	Window none = None;
-	setprop(root, NET_ACTIVE_WINDOW, XA_WINDOW, 32, &none, 1);
+	activewindow.value = None;
 
 	// Finally create the WM_CHECK window to announce our EWMH support.
 	wmcheckwin = XCreateWindow(dpy, root, 0, 0, 1, 1, 0, CopyFromParent,
@@ -263,6 +556,7 @@ void ewmh_startwm(void)
 
 void ewmh_stopwm(void)
 {
+	ewmh_flush();
 	XDestroyWindow(dpy, wmcheckwin);
 }
 
@@ -277,24 +571,33 @@ static void reloadwindowname(struct client *c)
 
 static void reloadwindowstate(struct client *c)
 {
-	Window w = cgetwin(c);
-	Bool skiptaskbar = False;
-	Bool isfullscreen = False;
+	unsigned bits = 0;
+	Bool clean = True;
 
 	unsigned long n = 0;
-	Atom *states = getprop(w, NET_WM_STATE, XA_ATOM, 32, &n);
-	for (int i = 0; i < n; i++)
-		if (states[i] == NET_WM_STATE_SKIP_TASKBAR)
-			skiptaskbar = True;
-		else if (states[i] == NET_WM_STATE_FULLSCREEN)
-			isfullscreen = True;
-		else
-			removestate(w, states[i]);
+	Atom *states = getprop(cgetwin(c), NET_WM_STATE, XA_ATOM, 32, &n);
+	for (unsigned long i = 0; i < n; i++) {
+		int k = atomindex(states[i], stateatoms, NELEM(stateatoms));
+		switch (k) {
+		case STATE_SKIP_TASKBAR:
+		case STATE_FULLSCREEN:
+		case STATE_ABOVE:
+		case STATE_BELOW:
+			bits |= STATEBIT(k);
+			break;
+		default:
+			clean = False;
+			break;
+		}
+	}
 	if (states != NULL)
 		XFree(states);
 
-	csetskiptaskbar(c, skiptaskbar);
-	csetfull(c, isfullscreen);
+	// Drop the states we don't honor from the property.
+	htinsert(&windowstates, cgetwin(c), (void *)(uintptr_t)(bits + 1));
+	if (!clean)
+		publishstates(c, bits);
+	applystates(c, bits);
 }
 
 static void reloadwindowtype(struct client *c)
@@ -319,8 +622,13 @@ static void reloadwindowdesktop(struct client *c)
 	unsigned long n = 0;
 	long *deskp = getprop(w, NET_WM_DESKTOP, XA_CARDINAL, 32, &n);
 	if (deskp != NULL) {
-		if (n == 1)
-			csetdesk(c, *deskp & 0xffffffffUL);
+		if (n == 1) {
+			// Don't write back what we just read
+			struct deskprop *p = getdeskprop(w);
+			p->published = *deskp & 0xffffffffUL;
+			p->ispublished = True;
+			csetdesk(c, p->published);
+		}
 		XFree(deskp);
 	} else
 		ewmh_notifyclientdesktop(w, cgetdesk(c));
@@ -369,6 +677,15 @@ void ewmh_unmanage(struct client *c)
 	Window w = cgetwin(c);
 	ewmh_notifyfocus(w, None);
 	delclient(w);
+	htremove(&windowstates, w);
+
+	// The desktop property outlives us, so publish it now.
+	struct deskprop *p = finddeskprop(w);
+	if (p != NULL) {
+		publishdeskprop(p);
+		deldeskprop(w);
+	}
+
 	XDeleteProperty(dpy, w, NET_WM_ALLOWED_ACTIONS);
 }
 
@@ -377,6 +694,8 @@ void ewmh_withdraw(struct client *c)
 	Window w = cgetwin(c);
 	ewmh_notifyfocus(w, None);
 	delclient(w);
+	deldeskprop(w);
+	htremove(&windowstates, w);
 	XDeleteProperty(dpy, w, NET_WM_ALLOWED_ACTIONS);
 	XDeleteProperty(dpy, w, NET_WM_DESKTOP);
 	XDeleteProperty(dpy, w, NET_WM_STATE);
@@ -403,124 +722,112 @@ void ewmh_notifyfocus(Window old, Window new)
 	static Window current = None;
 
 	if (old == None || old == current) {
-		setprop(root, NET_ACTIVE_WINDOW, XA_WINDOW, 32, &new, 1);
+		activewindow.value = new;
 		current = new;
+		stats.ewmhupdates++;
 	}
 }
 
 void ewmh_notifyrestack(void)
 {
-	Window *v;
-	size_t n;
-	getwindowstack(&v, &n);
-	setprop(root, NET_CLIENT_LIST_STACKING, XA_WINDOW, 32, v, n);
-	free(v);
+	stackingdirty = True;
+	stats.ewmhupdates++;
 }
 
-void ewmh_propertynotify(struct client *c, XPropertyEvent *e)
+static unsigned getstates(struct client *c)
 {
-	if (e->atom == NET_WM_NAME)
-		reloadwindowname(c);
+	uintptr_t v = (uintptr_t)htfind(&windowstates, cgetwin(c));
+	return v == 0 ? 0 : v - 1;
 }
 
-static Bool hasstate(Window w, Atom state)
+/*
+ * Records the states of a client, and writes them to its
+ * _NET_WM_STATE property if they changed.
+ */
+static void setstates(struct client *c, unsigned bits)
 {
-	unsigned long n = 0;
-	Atom *v = getprop(w, NET_WM_STATE, XA_ATOM, 32, &n);
-	Bool found = False;
-	for (unsigned long i = 0; i < n; i++)
-		if (v[i] == state) {
-			found = True;
-			break;
-		}
-	if (v != NULL)
-		XFree(v);
-	return found;
+	Window w = cgetwin(c);
+	uintptr_t v = (uintptr_t)htfind(&windowstates, w);
+	if (v == 0 || v - 1 != bits) {
+		htinsert(&windowstates, w, (void *)(uintptr_t)(bits + 1));
+		publishstates(c, bits);
+	}
 }
 
-/*
- * Removes a _NET_WM_STATE property (including duplicates).
- */
-static void removestate(Window w, Atom state)
+static void publishstates(struct client *c, unsigned bits)
 {
-	unsigned long n = 0;
-	Atom *v = getprop(w, NET_WM_STATE, XA_ATOM, 32, &n);
-	unsigned long k = 0;
-	for (unsigned long i = 0; i < n; i++)
-		if (v[i] != state)
-			v[k++] = v[i];
-	setprop(w, NET_WM_STATE, XA_ATOM, 32, v, k);
-	if (v != NULL)
-		XFree(v);
+	Atom v[NELEM(stateatoms)];
+	int n = 0;
+	for (int i = 0; i < NELEM(stateatoms); i++)
+		if (bits & STATEBIT(i))
+			v[n++] = *stateatoms[i].atom;
+	cownprop(c, NET_WM_STATE);
+	setprop(cgetwin(c), NET_WM_STATE, XA_ATOM, 32, v, n);
 }
 
-/*
- * Adds a _NET_WM_STATE property, unless it is already present.
- */
-static void addstate(Window w, Atom state)
+static void applystates(struct client *c, unsigned bits)
 {
-	unsigned long n = 0;
-	Atom *old = getprop(w, NET_WM_STATE, XA_ATOM, 32, &n);
-	Bool present = False;
-	for (unsigned long i = 0; i < n; i++)
-		if (old[i] == state) {
-			present = True;
-			break;
-		}
-	if (!present) {
-		Atom *new = xmalloc((n + 1) * sizeof (Atom));
-		memcpy(new, old, n * sizeof (Atom));
-		new[n] = state;
-		setprop(w, NET_WM_STATE, XA_ATOM, 32, new, n + 1);
-		free(new);
-	}
-	if (old != NULL)
-		XFree(old);
-}
-
-static void changestate(Window w, int how, Atom state)
-{
-	switch (how) {
-	case NET_WM_STATE_REMOVE:
-		removestate(w, state);
-		break;
-	case NET_WM_STATE_ADD:
-		addstate(w, state);
-		break;
-	case NET_WM_STATE_TOGGLE:
-		if (hasstate(w, state))
-			removestate(w, state);
-		else
-			addstate(w, state);
-		break;
-	}
+	csetskiptaskbar(c, (bits & STATEBIT(STATE_SKIP_TASKBAR)) != 0);
+	csetfull(c, (bits & STATEBIT(STATE_FULLSCREEN)) != 0);
+	csetabove(c, (bits & STATEBIT(STATE_ABOVE)) != 0);
+	csetbelow(c, (bits & STATEBIT(STATE_BELOW)) != 0);
 }
 
-void ewmh_notifyfull(Window w, Bool full)
+void ewmh_notifyfull(struct client *c, Bool full)
 {
-	if (full) {
-		if (!hasstate(w, NET_WM_STATE_FULLSCREEN))
-			addstate(w, NET_WM_STATE_FULLSCREEN);
-	} else
-		removestate(w, NET_WM_STATE_FULLSCREEN);
+	unsigned bits = getstates(c);
+	if (full)
+		bits |= STATEBIT(STATE_FULLSCREEN);
+	else
+		bits &= ~STATEBIT(STATE_FULLSCREEN);
+	setstates(c, bits);
 }
 
-void ewmh_clientmessage(struct client *c, XClientMessageEvent *e)
+static void activatewindow(struct client *c, XClientMessageEvent *e)
 {
-	if (e->message_type == NET_ACTIVE_WINDOW && e->format == 32) {
+	if (e->format == 32) {
 		cpopapp(c);
 		gotodesk(cgetdesk(c));
 		cfocus(c, (Time)e->data.l[1]);
-	} else if (e->message_type == NET_CLOSE_WINDOW && e->format == 32) {
+	}
+}
+
+static void closewindow(struct client *c, XClientMessageEvent *e)
+{
+	if (e->format == 32)
 		cdelete(c, (Time)e->data.l[0]);
-	} else if (e->message_type == NET_WM_DESKTOP && e->format == 32) {
+}
+
+static void setwindowdesktop(struct client *c, XClientMessageEvent *e)
+{
+	if (e->format == 32)
 		csetappdesk(c, e->data.l[0] & 0xffffffff);
-	} else if (e->message_type == NET_WM_STATE && e->format == 32) {
+}
+
+static void setwindowstate(struct client *c, XClientMessageEvent *e)
+{
+	if (e->format == 32) {
 		int how = e->data.l[0];
-		for (int i = 1; i <= 2; i++)
-			if (e->data.l[i] != 0)
-				changestate(cgetwin(c), how, e->data.l[i]);
-		reloadwindowstate(c);
+		unsigned bits = getstates(c);
+		for (int i = 1; i <= 2; i++) {
+			int k = atomindex(e->data.l[i], stateatoms,
+					NELEM(stateatoms));
+			if (k < 0 || k == STATE_HIDDEN)
+				continue;
+			switch (how) {
+			case NET_WM_STATE_REMOVE:
+				bits &= ~STATEBIT(k);
+				break;
+			case NET_WM_STATE_ADD:
+				bits |= STATEBIT(k);
+				break;
+			case NET_WM_STATE_TOGGLE:
+				bits ^= STATEBIT(k);
+				break;
+			}
+		}
+		setstates(c, bits);
+		applystates(c, bits);
 	}
 }
 
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
+#include <X11/Xproto.h>
 #include <X11/cursorfont.h>
 
 #include "wind.h"
@@ -73,6 +74,8 @@ static size_t fcount;
 static Cursor cursortopleft = None;
 static Cursor cursortopright = None;
 
+static DEFINE_POOL(framepool, struct frame);
+
 /*
  * XXX: We cheat here and always estimate normal frame
  * extents, even if the window is of a type that will
@@ -237,6 +240,8 @@ static void repaint(struct frame *f)
 
 static void confrequest(struct frame *f, XConfigureRequestEvent *e)
 {
+	compressconfrequest(e);
+
 	struct geometry g = cgetgeom(f->client);
 
 	if (e->value_mask & CWBorderWidth) {
@@ -326,6 +331,7 @@ static void moveresize(struct frame *f, int x, int y, int w, int h)
 
 static void motionnotify(struct frame *f, XMotionEvent *e)
 {
+	compressmotion(e);
 	moveresize(f, e->x_root - f->downx, e->y_root - f->downy,
 			f->width, f->height);
 }
@@ -375,7 +381,7 @@ struct frame *fcreate(struct client *c)
 	}
 	fcount++;
 
-	struct frame *f = xmalloc(sizeof *f);
+	struct frame *f = palloc(&framepool);
 
 	f->client = c;
 	f->pixmap = None;
@@ -403,6 +409,7 @@ struct frame *fcreate(struct client *c)
 
 	f->listener.function = event;
 	f->listener.pointer = f;
+	f->listener.name = "frame";
 	setlistener(f->window, &f->listener);
 
 	XSelectInput(dpy, f->window,
@@ -435,6 +442,7 @@ struct frame *fcreate(struct client *c)
 	setgrav(clientwin, NorthWestGravity);
 	if (cismapped(f->client))
 		cignoreunmap(f->client);
+	TRACK(X_ReparentWindow, clientwin);
 	XReparentWindow(dpy, clientwin, f->window, EXT_LEFT, EXT_TOP);
 
 	g.x += EXT_LEFT;
@@ -474,6 +482,7 @@ void fdestroy(struct frame *f)
 	g.x = f->x - dx;
 	g.y = f->y - dy;
 	csetgeom(f->client, g);
+	TRACK(X_ReparentWindow, clientwin);
 	XReparentWindow(dpy, clientwin, root, g.x, g.y);
 
 	ewmh_notifyframeextents(clientwin, (struct extents){
@@ -493,7 +502,7 @@ void fdestroy(struct frame *f)
 	if (f->pixmap != None)
 		XFreePixmap(dpy, f->pixmap);
 	XDestroyWindow(dpy, f->window);
-	free(f);
+	pfree(&framepool, f);
 
 	assert(fcount > 0);
 	fcount--;
@@ -20,13 +20,25 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
 
 #include "wind.h"
 
+// Elements of WM_HINTS, and of WM_NORMAL_HINTS in current and
+// pre-ICCCM versions
+#define NWMHINTS 9
+#define NSIZEHINTS 18
+#define OLDNSIZEHINTS 15
+
+static int getwindowproperty(Window, Atom, long, Atom, Atom *, int *,
+		unsigned long *, unsigned long *, unsigned char **);
+
 // Lock-mask permutations that should be grabbed in addition
 // to the modifiers specified to the functions below.
 static const unsigned lockmasks[] = {
@@ -66,6 +78,273 @@ char *xstrdup(const char *s)
 	return memcpy(xmalloc(n), s, n);
 }
 
+/*
+ * Returns a monotonic time in microseconds.
+ */
+unsigned long usecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Pools hand out objects from slabs of SLABSIZE bytes, so that
+ * objects of one type are kept together and freed objects are
+ * reused before the slab allocator asks malloc for more. Slabs
+ * are never returned.
+ */
+
+#define SLABSIZE 4096
+
+// Pools that have allocated slabs
+static struct pool *pools = NULL;
+
+// Alignment suitable for any object
+union align {
+	void *p;
+	long l;
+	double d;
+};
+
+static size_t objsize(struct pool *p)
+{
+	size_t a = sizeof (union align);
+	return (MAX(p->size, sizeof (void *)) + a - 1) / a * a;
+}
+
+void *palloc(struct pool *p)
+{
+	if (p->free == NULL) {
+		size_t size = objsize(p);
+		size_t n = MAX(SLABSIZE / size, 1);
+		char *slab = xmalloc(n * size);
+		for (size_t i = n; i > 0; i--) {
+			void **obj = (void **)(slab + (i - 1) * size);
+			*obj = p->free;
+			p->free = obj;
+		}
+		if (p->slabs++ == 0) {
+			p->next = pools;
+			pools = p;
+		}
+	}
+
+	void **obj = p->free;
+	p->free = *obj;
+	if (++p->live > p->peak)
+		p->peak = p->live;
+	return obj;
+}
+
+void pfree(struct pool *p, void *obj)
+{
+	if (obj == NULL)
+		return;
+	*(void **)obj = p->free;
+	p->free = obj;
+	p->live--;
+}
+
+void printpools(FILE *f)
+{
+	for (struct pool *p = pools; p != NULL; p = p->next)
+		fprintf(f, "%s: %lu live, %lu peak, %lu slabs of %zu\n",
+				p->name, p->live, p->peak, p->slabs,
+				MAX(SLABSIZE / objsize(p), 1));
+}
+
+/*
+ * Atoms are declared by the modules in tables, and interned
+ * together with a single request. The table entry of each atom is
+ * remembered, so that an atom can be mapped back to its position
+ * in the table that declared it.
+ */
+
+// Declared atoms not yet interned
+static const struct atomdef **atomdecls = NULL;
+static int natomdecls = 0;
+static int atomdeclslim = 0;
+
+// Table entries of interned atoms, by atom
+static struct hashtab atomdefs;
+
+void declareatoms(const struct atomdef *v, int n)
+{
+	if (natomdecls + n > atomdeclslim) {
+		atomdeclslim = MAX(natomdecls + n, 2 * atomdeclslim);
+		atomdecls = xrealloc(atomdecls,
+				atomdeclslim * sizeof atomdecls[0]);
+	}
+	for (int i = 0; i < n; i++)
+		atomdecls[natomdecls++] = &v[i];
+}
+
+/*
+ * Interns all atoms declared so far.
+ */
+void internatoms(void)
+{
+	if (natomdecls == 0)
+		return;
+
+	char **names = xmalloc(natomdecls * sizeof names[0]);
+	Atom *atoms = xmalloc(natomdecls * sizeof atoms[0]);
+	for (int i = 0; i < natomdecls; i++)
+		names[i] = (char *)atomdecls[i]->name;
+	XInternAtoms(dpy, names, natomdecls, False, atoms);
+	for (int i = 0; i < natomdecls; i++) {
+		*atomdecls[i]->atom = atoms[i];
+		htinsert(&atomdefs, atoms[i], (void *)atomdecls[i]);
+	}
+	free(names);
+	free(atoms);
+
+	free(atomdecls);
+	atomdecls = NULL;
+	natomdecls = 0;
+	atomdeclslim = 0;
+}
+
+/*
+ * Returns the position of an atom in the table of n entries that
+ * declared it, or -1 if it was not declared there.
+ */
+int atomindex(Atom a, const struct atomdef *v, int n)
+{
+	const struct atomdef *d = htfind(&atomdefs, a);
+	if (d == NULL || d < v || d >= v + n)
+		return -1;
+	return d - v;
+}
+
+/*
+ * Hash tables use open addressing with linear probing. The table
+ * size is a power of two, and the load factor is kept below one
+ * half. Removal shifts the following entries back into place, so
+ * there are no tombstones slowing down later lookups.
+ */
+
+static size_t hashxid(XID x, size_t lim)
+{
+	// XIDs allocated by one client are mostly sequential.
+	x ^= x >> 16;
+	return (size_t)((x * 2654435761UL) & 0xffffffffUL) & (lim - 1);
+}
+
+static struct hashentry *htlookup(struct hashtab *t, XID key)
+{
+	size_t mask = t->lim - 1;
+	size_t i = hashxid(key, t->lim);
+	while (t->v[i].key != key && t->v[i].key != 0)
+		i = (i + 1) & mask;
+	return &t->v[i];
+}
+
+/*
+ * Returns the value stored for key, or NULL if none.
+ */
+void *htfind(struct hashtab *t, XID key)
+{
+	if (t->n == 0)
+		return NULL;
+	return htlookup(t, key)->value;
+}
+
+/*
+ * Stores value for key, replacing any previous value. The key
+ * must not be zero.
+ */
+void htinsert(struct hashtab *t, XID key, void *value)
+{
+	if (2 * (t->n + 1) > t->lim) {
+		struct hashtab old = *t;
+		t->lim = old.lim == 0 ? 64 : 2 * old.lim;
+		t->n = 0;
+		t->v = xmalloc(t->lim * sizeof t->v[0]);
+		for (size_t i = 0; i < t->lim; i++)
+			t->v[i] = (struct hashentry){ 0, NULL };
+		for (size_t i = 0; i < old.lim; i++)
+			if (old.v[i].key != 0)
+				htinsert(t, old.v[i].key, old.v[i].value);
+		free(old.v);
+	}
+
+	struct hashentry *e = htlookup(t, key);
+	if (e->key == 0) {
+		e->key = key;
+		t->n++;
+	}
+	e->value = value;
+}
+
+/*
+ * Removes key from the table, if present.
+ */
+void htremove(struct hashtab *t, XID key)
+{
+	if (t->n == 0)
+		return;
+
+	size_t mask = t->lim - 1;
+	struct hashentry *e = htlookup(t, key);
+	if (e->key == 0)
+		return;
+	size_t i = e - t->v;
+	t->v[i] = (struct hashentry){ 0, NULL };
+	t->n--;
+
+	// Move back entries that probed past the freed slot.
+	for (size_t j = (i + 1) & mask; t->v[j].key != 0; j = (j + 1) & mask) {
+		size_t k = hashxid(t->v[j].key, t->lim);
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			t->v[i] = t->v[j];
+			t->v[j] = (struct hashentry){ 0, NULL };
+			i = j;
+		}
+	}
+
+	if (t->n == 0) {
+		free(t->v);
+		t->v = NULL;
+		t->lim = 0;
+	}
+}
+
+static struct hashtab listeners;
+
+/*
+ * Cache of the last listener lookup. Events tend to come in runs
+ * for the same window, for example while a frame is dragged.
+ */
+static Window lastwindow = None;
+static struct listener *lastlistener = NULL;
+
+void setlistener(Window w, const struct listener *l)
+{
+	if (w == lastwindow)
+		lastwindow = None;
+	if (l == NULL)
+		htremove(&listeners, w);
+	else
+		htinsert(&listeners, w, (void *)l);
+}
+
+/*
+ * Returns the listener of a window, or NULL if none.
+ */
+struct listener *getlistener(Window w)
+{
+	stats.lookups++;
+	if (w == lastwindow && w != None) {
+		stats.lookupcachehits++;
+		return lastlistener;
+	}
+	lastwindow = w;
+	lastlistener = htfind(&listeners, w);
+	return lastlistener;
+}
+
 /*
  * Grabs a key. See manual page of XGrabKey.
  */
@@ -126,6 +405,31 @@ void ungrabbutton(unsigned button, unsigned modifiers, Window grabwin)
 					grabwin);
 }
 
+/*
+ * Like XGetWindowProperty with an offset of zero, but uses the
+ * prefetched value of the property if there is one.
+ */
+static int getwindowproperty(Window w, Atom prop, long len, Atom type,
+		Atom *rtype, int *rfmt, unsigned long *rcount,
+		unsigned long *rafter, unsigned char **rdata)
+{
+	if (getprefetchedprop(w, prop, type, rtype, rfmt, rcount, rafter,
+			rdata))
+		return Success;
+	return XGetWindowProperty(dpy, w, prop, 0L, len, False, type,
+			rtype, rfmt, rcount, rafter, rdata);
+}
+
+/*
+ * Like XGetWindowAttributes, but uses the prefetched attributes
+ * if there are any.
+ */
+Bool getwindowattributes(Window w, XWindowAttributes *a)
+{
+	return getprefetchedattributes(w, a) ||
+			XGetWindowAttributes(dpy, w, a);
+}
+
 /*
  * Returns the WM_STATE hint of a client window
  */
@@ -136,7 +440,7 @@ long getwmstate(Window w)
 	Atom actualtype;
 	int actualformat;
 	long state = WithdrawnState;
-	if (XGetWindowProperty(dpy, w, WM_STATE, 0L, 2L, False, WM_STATE,
+	if (getwindowproperty(w, WM_STATE, 2L, WM_STATE,
 			&actualtype, &actualformat, &nitems,
 			&bytesafter, &prop) == Success) {
 		if (nitems > 0)
@@ -153,6 +457,7 @@ long getwmstate(Window w)
 void setwmstate(Window w, long state)
 {
 	long data[2] = { state, None };
+	prefetchforget(w, WM_STATE);
 	XChangeProperty(dpy, w, WM_STATE, WM_STATE, 32,
 			PropModeReplace, (unsigned char *)data, 2);
 }
@@ -163,7 +468,121 @@ void setwmstate(Window w, long state)
 Bool ismapped(Window w)
 {
 	XWindowAttributes a;
-	return XGetWindowAttributes(dpy, w, &a) && a.map_state != IsUnmapped;
+	return getwindowattributes(w, &a) && a.map_state != IsUnmapped;
+}
+
+/*
+ * Returns the WM_HINTS of a window, or NULL if it has none.
+ * Free with XFree. See manual page of XGetWMHints.
+ */
+XWMHints *getwmhints(Window w)
+{
+	unsigned long n = 0;
+	long *v = getprop(w, XA_WM_HINTS, XA_WM_HINTS, 32, &n);
+	if (v == NULL)
+		return NULL;
+	XWMHints *h = NULL;
+	if (n >= NWMHINTS - 1 && (h = XAllocWMHints()) != NULL) {
+		h->flags = v[0];
+		h->input = v[1] ? True : False;
+		h->initial_state = v[2];
+		h->icon_pixmap = v[3];
+		h->icon_window = v[4];
+		h->icon_x = v[5];
+		h->icon_y = v[6];
+		h->icon_mask = v[7];
+		h->window_group = n >= NWMHINTS ? v[8] : None;
+	}
+	XFree(v);
+	return h;
+}
+
+/*
+ * Reads the WM_NORMAL_HINTS of a window into h. Returns False,
+ * leaving h unchanged, if it has none. See manual page of
+ * XGetWMNormalHints.
+ */
+Bool getwmnormalhints(Window w, XSizeHints *h)
+{
+	unsigned long n = 0;
+	long *v = getprop(w, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 32, &n);
+	if (v == NULL)
+		return False;
+	if (n < OLDNSIZEHINTS) {
+		XFree(v);
+		return False;
+	}
+	long supplied = USPosition | USSize | PAllHints;
+	h->flags = v[0];
+	h->x = v[1];
+	h->y = v[2];
+	h->width = v[3];
+	h->height = v[4];
+	h->min_width = v[5];
+	h->min_height = v[6];
+	h->max_width = v[7];
+	h->max_height = v[8];
+	h->width_inc = v[9];
+	h->height_inc = v[10];
+	h->min_aspect.x = v[11];
+	h->min_aspect.y = v[12];
+	h->max_aspect.x = v[13];
+	h->max_aspect.y = v[14];
+	if (n >= NSIZEHINTS) {
+		h->base_width = v[15];
+		h->base_height = v[16];
+		h->win_gravity = v[17];
+		supplied |= PBaseSize | PWinGravity;
+	}
+	h->flags &= supplied;
+	XFree(v);
+	return True;
+}
+
+/*
+ * Returns the decoded WM_NAME of a window, or NULL if it has none.
+ * Free with free.
+ */
+char *getwmname(Window w)
+{
+	XTextProperty p;
+	unsigned long after;
+	if (getwindowproperty(w, XA_WM_NAME, 1000000L, AnyPropertyType,
+			&p.encoding, &p.format, &p.nitems, &after,
+			&p.value) != Success || p.encoding == None)
+		return NULL;
+	char *s = decodetextproperty(&p);
+	if (p.value != NULL)
+		XFree(p.value);
+	return s;
+}
+
+/*
+ * Returns the WM_PROTOCOLS of a window, or NULL if it has none.
+ * Free with XFree.
+ */
+Atom *getwmprotocols(Window w, int *np)
+{
+	unsigned long n = 0;
+	Atom *v = getprop(w, WM_PROTOCOLS, XA_ATOM, 32, &n);
+	*np = v == NULL ? 0 : n;
+	return v;
+}
+
+/*
+ * Returns the WM_TRANSIENT_FOR hint of a window, or None.
+ */
+Window gettransientfor(Window w)
+{
+	unsigned long n = 0;
+	Window *v = getprop(w, XA_WM_TRANSIENT_FOR, XA_WINDOW, 32, &n);
+	Window owner = None;
+	if (v != NULL) {
+		if (n > 0)
+			owner = v[0];
+		XFree(v);
+	}
+	return owner;
 }
 
 char *decodetextproperty(XTextProperty *p)
@@ -181,29 +600,46 @@ char *decodetextproperty(XTextProperty *p)
 
 void setprop(Window w, Atom prop, Atom type, int fmt, void *ptr, int nelem)
 {
+	prefetchforget(w, prop);
 	XChangeProperty(dpy, w, prop, type, fmt, PropModeReplace, ptr, nelem);
 }
 
+void appendprop(Window w, Atom prop, Atom type, int fmt, void *ptr,
+		int nelem)
+{
+	prefetchforget(w, prop);
+	XChangeProperty(dpy, w, prop, type, fmt, PropModeAppend, ptr, nelem);
+}
+
+/*
+ * Returns the value of a property, or NULL if it does not exist or
+ * has another type or format. Free with XFree. A property too long
+ * for the first request is fetched again, in full, with a request
+ * sized after the first reply.
+ */
 void *getprop(Window w, Atom prop, Atom type, int fmt, unsigned long *rcountp)
 {
 	void *ptr = NULL;
-	unsigned long count = 32;
+	long count = 32;
 	Atom rtype;
 	int rfmt;
 	unsigned long rafter;
 	for (;;) {
-		if (XGetWindowProperty(dpy, w, prop, 0L, count,
-				False, type, &rtype, &rfmt, rcountp,
+		if (getwindowproperty(w, prop, count,
+				type, &rtype, &rfmt, rcountp,
 				&rafter, (unsigned char **)&ptr) != Success) {
 			// Error
 			return NULL;
 		} else if (rtype != type || rfmt != fmt) {
 			// Does not exist (type=None), or wrong type/format
+			if (ptr != NULL)
+				XFree(ptr);
 			return NULL;
 		} else if (rafter > 0) {
+			// Only fetched again if it grew in between
+			count = (*rcountp * (fmt / 8) + rafter + 3) / 4;
 			XFree(ptr);
 			ptr = NULL;
-			count *= 2;
 		} else {
 			return ptr;
 		}
@@ -224,3 +660,94 @@ unsigned long getpixel(const char *name)
 	XAllocNamedColor(dpy, DefaultColormap(dpy, scr), name, &sc, &tc);
 	return sc.pixel;
 }
+
+/*
+ * Replace a MotionNotify event with the newest of the motion events
+ * for the same window that immediately follow it in the event queue.
+ * Motion events behind any other event are left alone, so the order
+ * of events such as button releases is preserved.
+ */
+void compressmotion(XMotionEvent *e)
+{
+	XEvent next;
+	while (XEventsQueued(dpy, QueuedAfterReading) > 0) {
+		XPeekEvent(dpy, &next);
+		if (next.type != MotionNotify || next.xmotion.window != e->window)
+			break;
+		XNextEvent(dpy, &next);
+		*e = next.xmotion;
+		stats.motioncoalesced++;
+	}
+}
+
+struct confscan {
+	Window window;
+	Bool blocked;
+};
+
+/*
+ * Predicate for XCheckIfEvent matching ConfigureRequest events for
+ * a window, up to the first other event concerning that window.
+ */
+static Bool isconfrequest(Display *display, XEvent *e, XPointer arg)
+{
+	struct confscan *scan = (struct confscan *)arg;
+	if (scan->blocked)
+		return False;
+
+	Window w;
+	switch (e->type) {
+	case ConfigureRequest:
+		if (e->xconfigurerequest.window == scan->window)
+			return True;
+		w = e->xconfigurerequest.window;
+		break;
+	case MapRequest:
+		w = e->xmaprequest.window;
+		break;
+	case UnmapNotify:
+		w = e->xunmap.window;
+		break;
+	case DestroyNotify:
+		w = e->xdestroywindow.window;
+		break;
+	default:
+		w = e->xany.window;
+		break;
+	}
+	if (w == scan->window || e->xany.window == scan->window)
+		scan->blocked = True;
+	return False;
+}
+
+/*
+ * Merge the ConfigureRequest events for the same window that are
+ * waiting in the event queue into e, so that only the final geometry
+ * is acted upon. Requests queued behind some other event for the
+ * window are left alone.
+ */
+void compressconfrequest(XConfigureRequestEvent *e)
+{
+	struct confscan scan = { e->window, False };
+	XEvent next;
+	while (XCheckIfEvent(dpy, &next, isconfrequest, (XPointer)&scan)) {
+		XConfigureRequestEvent *n = &next.xconfigurerequest;
+		if (n->value_mask & CWX)
+			e->x = n->x;
+		if (n->value_mask & CWY)
+			e->y = n->y;
+		if (n->value_mask & CWWidth)
+			e->width = n->width;
+		if (n->value_mask & CWHeight)
+			e->height = n->height;
+		if (n->value_mask & CWBorderWidth)
+			e->border_width = n->border_width;
+		if (n->value_mask & CWSibling)
+			e->above = n->above;
+		if (n->value_mask & CWStackMode)
+			e->detail = n->detail;
+		e->value_mask |= n->value_mask;
+		scan.blocked = False;
+		stats.confcoalesced++;
+	}
+}
@@ -31,7 +31,7 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <X11/Xlib.h>
-#include <X11/Xresource.h>
+#include <X11/Xproto.h>
 #include <X11/Xutil.h>
 
 #include "wind.h"
@@ -40,10 +40,19 @@
 #include "delodd.xbm"
 
 static int errhandler(Display *, XErrorEvent *);
+static struct trackedrequest *findtracked(unsigned long);
+static Bool samebatch(unsigned long, unsigned long);
 static void onsignal(int);
 static int waitevent(void);
+static void dispatch(XEvent *);
+static void countbatch(unsigned long);
+static void printstats(FILE *);
+#ifdef PROFILE
+static void addsample(unsigned long *, unsigned long);
+static void printhist(FILE *, const char *, unsigned long *);
+static void printprofile(FILE *);
+#endif
 static void usage(FILE *);
-static struct listener *getlistener(Window);
 
 enum runlevel runlevel = RL_STARTUP;
 
@@ -57,8 +66,8 @@ static const char *progname;
 static int exitstatus;
 
 /*
- * If true, enable debug mode. This will enable synchronous
- * X11 transactions, and print Xlib errors to standard error.
+ * If true, enable debug mode. This will print Xlib errors,
+ * and the requests they are attributed to, to standard error.
  */
 static Bool debug = False;
 
@@ -87,15 +96,112 @@ struct font *font;
 struct fontcolor *fhighlight;
 struct fontcolor *fnormal;
 
+struct stats stats;
+
 Atom WM_CHANGE_STATE;
 Atom WM_DELETE_WINDOW;
 Atom WM_PROTOCOLS;
 Atom WM_STATE;
 
-static XContext listeners;
+static const struct atomdef wmatoms[] = {
+	{ &WM_CHANGE_STATE, "WM_CHANGE_STATE" },
+	{ &WM_DELETE_WINDOW, "WM_DELETE_WINDOW" },
+	{ &WM_PROTOCOLS, "WM_PROTOCOLS" },
+	{ &WM_STATE, "WM_STATE" },
+};
 
 static sigset_t sigmask;
 
+// Set by SIGUSR1 to request a statistics dump
+static volatile sig_atomic_t dumprequested = 0;
+
+#ifdef PROFILE
+/*
+ * Event loop profile, enabled by defining PROFILE at compile time.
+ * Times are collected in histograms of powers of two microseconds:
+ * less than 1, 1, 2-3, 4-7, ..., and 2^(NBUCKETS-2) and up.
+ */
+#define NBUCKETS 20
+
+// Handling time per event type
+static unsigned long eventtime[LASTEvent][NBUCKETS];
+
+// Handling time per listener kind, including nested redirects
+static struct {
+	const char *name;
+	unsigned long hist[NBUCKETS];
+} listenertime[8];
+
+/*
+ * Delay between the server timestamp of an event and its dispatch.
+ * The server clock has an unknown offset from ours, so the smallest
+ * offset seen so far is taken to be zero delay.
+ */
+static unsigned long eventlag[NBUCKETS];
+static Bool haslagbase = False;
+static unsigned long lagbase;
+
+static const char *eventnames[LASTEvent] = {
+	[KeyPress] = "KeyPress",
+	[KeyRelease] = "KeyRelease",
+	[ButtonPress] = "ButtonPress",
+	[ButtonRelease] = "ButtonRelease",
+	[MotionNotify] = "MotionNotify",
+	[EnterNotify] = "EnterNotify",
+	[LeaveNotify] = "LeaveNotify",
+	[FocusIn] = "FocusIn",
+	[FocusOut] = "FocusOut",
+	[KeymapNotify] = "KeymapNotify",
+	[Expose] = "Expose",
+	[GraphicsExpose] = "GraphicsExpose",
+	[NoExpose] = "NoExpose",
+	[VisibilityNotify] = "VisibilityNotify",
+	[CreateNotify] = "CreateNotify",
+	[DestroyNotify] = "DestroyNotify",
+	[UnmapNotify] = "UnmapNotify",
+	[MapNotify] = "MapNotify",
+	[MapRequest] = "MapRequest",
+	[ReparentNotify] = "ReparentNotify",
+	[ConfigureNotify] = "ConfigureNotify",
+	[ConfigureRequest] = "ConfigureRequest",
+	[GravityNotify] = "GravityNotify",
+	[ResizeRequest] = "ResizeRequest",
+	[CirculateNotify] = "CirculateNotify",
+	[CirculateRequest] = "CirculateRequest",
+	[PropertyNotify] = "PropertyNotify",
+	[SelectionClear] = "SelectionClear",
+	[SelectionRequest] = "SelectionRequest",
+	[SelectionNotify] = "SelectionNotify",
+	[ColormapNotify] = "ColormapNotify",
+	[ClientMessage] = "ClientMessage",
+	[MappingNotify] = "MappingNotify",
+};
+#endif
+
+/*
+ * Ring buffer of recently tracked requests. Errors arrive
+ * asynchronously, and are reported along with the tracked
+ * request that failed, or else with the last tracked request
+ * issued before it in the same batch.
+ */
+#define NTRACKED 64
+static struct trackedrequest {
+	unsigned long serial;
+	int opcode;
+	XID resource;
+	const char *file;
+	int line;
+} tracked[NTRACKED];
+static unsigned long ntracked = 0;
+
+/*
+ * Serial numbers of the first requests after the last two
+ * flushes of the event loop. They delimit the batches that
+ * errors are attributed within.
+ */
+static unsigned long lastflush = 0;
+static unsigned long prevflush = 0;
+
 /*
  * Print formatted error message
  */
@@ -109,30 +215,75 @@ void errorf(const char *fmt, ...)
 	fprintf(stderr, "\n");
 }
 
-void setlistener(Window w, const struct listener *l)
+int redirect(XEvent *e, Window w)
 {
+	struct listener *l = getlistener(w);
 	if (l == NULL)
-		XDeleteContext(dpy, w, listeners);
-	else
-		XSaveContext(dpy, w, listeners, (XPointer)l);
+		return -1;
+#ifdef PROFILE
+	unsigned long t = usecs();
+	l->function(l->pointer, e);
+	t = usecs() - t;
+	for (int i = 0; i < NELEM(listenertime); i++)
+		if (listenertime[i].name == NULL ||
+				listenertime[i].name == l->name) {
+			listenertime[i].name = l->name;
+			addsample(listenertime[i].hist, t);
+			break;
+		}
+#else
+	l->function(l->pointer, e);
+#endif
+	return 0;
 }
 
-static struct listener *getlistener(Window w)
+/*
+ * Remember the serial number of the next request, along with the
+ * resource it operates on and the call site.
+ */
+void trackrequest(int opcode, XID resource, const char *file, int line)
 {
-	struct listener *l;
-	if (XFindContext(dpy, w, listeners, (XPointer *)&l) == 0)
-		return l;
+	unsigned long serial = NextRequest(dpy);
+	struct trackedrequest *t;
+	if (ntracked > 0 && tracked[(ntracked - 1) % NTRACKED].serial == serial)
+		t = &tracked[(ntracked - 1) % NTRACKED];
 	else
-		return NULL;
+		t = &tracked[ntracked++ % NTRACKED];
+	t->serial = serial;
+	t->opcode = opcode;
+	t->resource = resource;
+	t->file = file;
+	t->line = line;
 }
 
-int redirect(XEvent *e, Window w)
+/*
+ * Find the last tracked request with a serial number not greater
+ * than the specified one. Returns NULL if there is none left in
+ * the buffer.
+ */
+static struct trackedrequest *findtracked(unsigned long serial)
 {
-	struct listener *l = getlistener(w);
-	if (l == NULL)
-		return -1;
-	l->function(l->pointer, e);
-	return 0;
+	unsigned long n = MIN(ntracked, NTRACKED);
+	for (unsigned long i = 1; i <= n; i++) {
+		struct trackedrequest *t = &tracked[(ntracked - i) % NTRACKED];
+		if ((long)(serial - t->serial) >= 0)
+			return t;
+	}
+	return NULL;
+}
+
+/*
+ * Tells if two requests were sent in the same batch, as far as
+ * the recorded flushes can tell.
+ */
+static Bool samebatch(unsigned long s1, unsigned long s2)
+{
+	if ((long)(s1 - lastflush) >= 0)
+		return (long)(s2 - lastflush) >= 0;
+	if ((long)(s1 - prevflush) >= 0)
+		return (long)(s2 - prevflush) >= 0 &&
+				(long)(s2 - lastflush) < 0;
+	return False;
 }
 
 static int errhandler(Display *dpy, XErrorEvent *e)
@@ -140,14 +291,40 @@ static int errhandler(Display *dpy, XErrorEvent *e)
 	static char buf[128];
 	buf[0] = '\0';
 	XGetErrorText(dpy, e->error_code, buf, sizeof buf);
-	if (debug)
-		errorf("Xlib: %s", buf);
 	xerror = buf;
+	stats.xerrors++;
+
+	struct trackedrequest *t = findtracked(e->serial);
+	Bool at = t != NULL && t->serial == e->serial &&
+			t->opcode == e->request_code;
+	if (at)
+		stats.xerrorstracked++;
+	else if (t != NULL && !samebatch(e->serial, t->serial))
+		t = NULL;
+
+	if (debug) {
+		char req[64];
+		char num[16];
+		snprintf(num, sizeof num, "%d", e->request_code);
+		XGetErrorDatabaseText(dpy, "XRequest", num, num,
+				req, sizeof req);
+		if (t == NULL)
+			errorf("Xlib: %s in %s on 0x%lx (request %lu)",
+					buf, req, e->resourceid, e->serial);
+		else
+			errorf("Xlib: %s in %s on 0x%lx (request %lu) "
+					"%s %s:%d on 0x%lx",
+					buf, req, e->resourceid, e->serial,
+					at ? "at" : "after",
+					t->file, t->line, t->resource);
+	}
 	return 0;
 }
 
 static void onsignal(int signo)
 {
+	if (signo == SIGUSR1)
+		dumprequested = 1;
 }
 
 static int waitevent(void)
@@ -163,10 +340,21 @@ static int waitevent(void)
 	FD_SET(conn, &rfds);
 	nfds = MAX(conn + 1, nfds);
 
-	if (pselect(nfds, &rfds, NULL, NULL, NULL, &sigmask) == -1) {
+	// Wake up in time for the next timer, if any.
+	struct timespec timeout;
+	Bool hastimeout = tnexttimeout(&timeout);
+
+	int n = pselect(nfds, &rfds, NULL, NULL,
+			hastimeout ? &timeout : NULL, &sigmask);
+	if (n == -1) {
+		if (errno == EINTR && dumprequested)
+			return 0;
 		errorf("pselect: %s", strerror(errno));
 		exitstatus = 1;
 		return -1;
+	} else if (n == 0) {
+		// Timeout
+		return 0;
 	} else if (FD_ISSET(conn, &rfds)) {
 		// Normal X event
 		return 0;
@@ -178,6 +366,165 @@ static int waitevent(void)
 	}
 }
 
+static void dispatch(XEvent *e)
+{
+#ifdef PROFILE
+	unsigned long t = usecs();
+	Time xtime = CurrentTime;
+	switch (e->type) {
+	case KeyPress:
+	case KeyRelease:
+		xtime = e->xkey.time;
+		break;
+	case ButtonPress:
+	case ButtonRelease:
+		xtime = e->xbutton.time;
+		break;
+	case MotionNotify:
+		xtime = e->xmotion.time;
+		break;
+	case EnterNotify:
+	case LeaveNotify:
+		xtime = e->xcrossing.time;
+		break;
+	case PropertyNotify:
+		xtime = e->xproperty.time;
+		break;
+	}
+	if (xtime != CurrentTime) {
+		// Server time is in milliseconds and wraps at 32 bits.
+		unsigned long offset = (t / 1000 - xtime) & 0xffffffffUL;
+		if (!haslagbase || offset < lagbase) {
+			lagbase = offset;
+			haslagbase = True;
+		}
+		addsample(eventlag, (offset - lagbase) * 1000);
+	}
+#endif
+
+	if (redirect(e, e->xany.window) == -1) {
+		/*
+		 * EWMH specifies some root window client
+		 * messages with a non-root event window,
+		 * so we need to redirect those manually.
+		 */
+		if (e->type == ClientMessage)
+			redirect(e, root);
+	}
+
+#ifdef PROFILE
+	if (e->type < LASTEvent)
+		addsample(eventtime[e->type], usecs() - t);
+#endif
+}
+
+static void countbatch(unsigned long n)
+{
+	stats.batches++;
+	stats.events += n;
+	stats.maxbatch = MAX(stats.maxbatch, n);
+	int i = 0;
+	while (n > 1 && i < NELEM(stats.batchsizes) - 1) {
+		n >>= 1;
+		i++;
+	}
+	stats.batchsizes[i]++;
+}
+
+static void printstats(FILE *f)
+{
+	fprintf(f, "events: %lu in %lu batches (largest %lu)\n",
+			stats.events, stats.batches, stats.maxbatch);
+	fprintf(f, "batch sizes:");
+	for (int i = 0; i < NELEM(stats.batchsizes); i++)
+		fprintf(f, " %d%s:%lu", 1 << i,
+				i == NELEM(stats.batchsizes) - 1 ? "+" : "",
+				stats.batchsizes[i]);
+	fprintf(f, "\n");
+	fprintf(f, "restacks: %lu for %lu requests (%lu windows moved)\n",
+			stats.restacks, stats.restackrequests,
+			stats.restackmoves);
+	fprintf(f, "EWMH property writes: %lu for %lu changes\n",
+			stats.ewmhwrites, stats.ewmhupdates);
+	fprintf(f, "stacking order writes: %lu (%lu unchanged skipped)\n",
+			stats.stackingwritten, stats.stackingskipped);
+	fprintf(f, "listener lookups: %lu (%lu cached)\n",
+			stats.lookups, stats.lookupcachehits);
+	fprintf(f, "motion events coalesced: %lu\n",
+			stats.motioncoalesced);
+	fprintf(f, "properties reloaded: %lu for %lu notifications\n",
+			stats.propreloads, stats.propevents);
+	fprintf(f, "configure requests coalesced: %lu\n",
+			stats.confcoalesced);
+	fprintf(f, "timers run: %lu\n", stats.timers);
+	fprintf(f, "X errors: %lu (%lu attributed)\n",
+			stats.xerrors, stats.xerrorstracked);
+	fprintf(f, "stack snapshots: %lu (%lu buffer allocations)\n",
+			stats.stacksnapshots, stats.stackallocs);
+	fprintf(f, "startup: %lu of %lu windows adopted in %lu us "
+			"(query %lu, manage %lu, restack and map %lu)\n",
+			stats.startupadopted, stats.startupwindows,
+			stats.startupquery + stats.startupmanage +
+			stats.startuprestack,
+			stats.startupquery, stats.startupmanage,
+			stats.startuprestack);
+	printpools(f);
+#ifdef PROFILE
+	printprofile(f);
+#endif
+}
+
+#ifdef PROFILE
+static void addsample(unsigned long *hist, unsigned long us)
+{
+	int i = 0;
+	while (us > 0 && i < NBUCKETS - 1) {
+		us >>= 1;
+		i++;
+	}
+	hist[i]++;
+}
+
+static void printhist(FILE *f, const char *name, unsigned long *hist)
+{
+	unsigned long n = 0;
+	for (int i = 0; i < NBUCKETS; i++)
+		n += hist[i];
+	if (n == 0)
+		return;
+
+	fprintf(f, "  %-17s %8lu:", name, n);
+	for (int i = 0; i < NBUCKETS; i++)
+		if (hist[i] != 0)
+			fprintf(f, " %lu%s:%lu", i == 0 ? 0 : 1UL << (i - 1),
+					i == NBUCKETS - 1 ? "+" : "",
+					hist[i]);
+	fprintf(f, "\n");
+}
+
+static void printprofile(FILE *f)
+{
+	fprintf(f, "event handling time (us):\n");
+	for (int i = 0; i < LASTEvent; i++) {
+		char buf[16];
+		const char *name = eventnames[i];
+		if (name == NULL) {
+			snprintf(buf, sizeof buf, "event %d", i);
+			name = buf;
+		}
+		printhist(f, name, eventtime[i]);
+	}
+
+	fprintf(f, "listener time (us):\n");
+	for (int i = 0; i < NELEM(listenertime) &&
+			listenertime[i].name != NULL; i++)
+		printhist(f, listenertime[i].name, listenertime[i].hist);
+
+	fprintf(f, "event delay (us):\n");
+	printhist(f, "timestamped", eventlag);
+}
+#endif
+
 static void usage(FILE *f)
 {
 	fprintf(f, "usage: %s [ -v ]"
@@ -258,7 +605,7 @@ int main(int argc, char *argv[])
 
 	if (debug) {
 		fprintf(stderr, "%s\n", PACKAGE_STRING);
-		fprintf(stderr, "Synchronous DEBUG mode enabled. "
+		fprintf(stderr, "DEBUG mode enabled. "
 				"Printing Xlib errors on standard error.\n");
 		fprintf(stderr, "Report bugs to <%s>.\n", PACKAGE_BUGREPORT);
 	}
@@ -271,8 +618,6 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	XSynchronize(dpy, debug);
-
 	scr = DefaultScreen(dpy);
 	root = DefaultRootWindow(dpy);
 
@@ -318,8 +663,6 @@ int main(int argc, char *argv[])
 				.foreground = hlbackgroundpixel,
 				.background = hlforegroundpixel });
 
-	listeners = XUniqueContext();
-
 	sigset_t sigsafemask;
 	sigprocmask(SIG_SETMASK, NULL, &sigmask);
 	sigprocmask(SIG_SETMASK, NULL, &sigsafemask);
@@ -348,13 +691,21 @@ int main(int argc, char *argv[])
 		sigaddset(&sigsafemask, SIGTERM);
 	}
 
+	// Statistics are only dumped in debug mode.
+	sigaction(SIGUSR1, NULL, &osa);
+	if (debug && osa.sa_handler != SIG_IGN) {
+		sigaction(SIGUSR1, &sa, NULL);
+		sigaddset(&sigsafemask, SIGUSR1);
+	}
+
 	sigprocmask(SIG_SETMASK, &sigsafemask, NULL);
 
-	WM_CHANGE_STATE = XInternAtom(dpy, "WM_CHANGE_STATE", False);
-	WM_DELETE_WINDOW = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
-	WM_PROTOCOLS = XInternAtom(dpy, "WM_PROTOCOLS", False);
-	WM_STATE = XInternAtom(dpy, "WM_STATE", False);
+	declareatoms(wmatoms, NELEM(wmatoms));
+	ewmh_declareatoms();
+	mwm_declareatoms();
+	internatoms();
 
+	initclient();
 	initroot();
 	ewmh_startwm();
 	mwm_startwm();
@@ -366,22 +717,45 @@ int main(int argc, char *argv[])
 	manageall();
 
 	refocus(CurrentTime);
+	updateclients();
+	restack();
+	ewmh_flush();
 
 	runlevel = RL_NORMAL;
 
 	while (waitevent() != -1) {
-		XEvent e;
-		XNextEvent(dpy, &e);
-		if (redirect(&e, e.xany.window) == -1) {
-			/*
-			 * EWMH specifies some root window client
-			 * messages with a non-root event window,
-			 * so we need to redirect those manually.
-			 */
-			if (e.type == ClientMessage)
-				redirect(&e, root);
+		/*
+		 * Dispatch all events that are already queued as
+		 * one batch, and do the deferred work once for the
+		 * whole batch instead of once per event. Events that
+		 * arrive while the batch is dispatched are left for
+		 * the next batch, so a flood of events cannot hold
+		 * back the deferred work indefinitely. Handlers may
+		 * consume queued events themselves, so the queue can
+		 * run dry before the count is reached.
+		 */
+		int n = XEventsQueued(dpy, QueuedAfterReading);
+		int i;
+		for (i = 0; i < n && XEventsQueued(dpy, QueuedAlready) > 0;
+				i++) {
+			XEvent e;
+			XNextEvent(dpy, &e);
+			dispatch(&e);
 		}
+		if (i > 0)
+			countbatch(i);
+		runtimers();
+		updateclients();
 		restack();
+		ewmh_flush();
+		prevflush = lastflush;
+		lastflush = NextRequest(dpy);
+		XFlush(dpy);
+
+		if (dumprequested) {
+			dumprequested = 0;
+			printstats(stderr);
+		}
 	}
 
 	runlevel = RL_SHUTDOWN;
@@ -408,6 +782,9 @@ int main(int argc, char *argv[])
 
 	ewmh_stopwm();
 
+	if (debug)
+		printstats(stderr);
+
 	ftfreecolor(fnormal);
 	ftfreecolor(fhighlight);
 	ftfree(font);
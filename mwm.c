@@ -57,20 +57,23 @@ static Atom MOTIF_WM_HINTS;
 static void reloadmwmhints(struct client *);
 static mwmhints *getmwmhints(struct client *);
 
-void mwm_startwm(void)
+static const struct atomdef mwmatoms[] = {
+	{ &MOTIF_WM_HINTS, "_MOTIF_WM_HINTS" },
+};
+
+void mwm_declareatoms(void)
 {
-	MOTIF_WM_HINTS = XInternAtom(dpy, "_MOTIF_WM_HINTS", False);
+	declareatoms(mwmatoms, NELEM(mwmatoms));
 }
 
-void mwm_manage(struct client *c)
+void mwm_startwm(void)
 {
-	reloadmwmhints(c);
+	addprophandler(MOTIF_WM_HINTS, reloadmwmhints);
 }
 
-void mwm_propertynotify(struct client *c, XPropertyEvent *e)
+void mwm_manage(struct client *c)
 {
-	if (e->atom == MOTIF_WM_HINTS)
-		reloadmwmhints(c);
+	reloadmwmhints(c);
 }
 
 /*
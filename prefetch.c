@@ -0,0 +1,375 @@
+/*
+ * Copyright 2010 Johan Veenhuizen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Pipelined queries for windows about to be managed, and for
+ * properties about to be reloaded.
+ *
+ * Xlib waits for the reply to each query before it sends the next
+ * one, so reading the attributes and a dozen properties of a window
+ * costs a dozen round trips. Instead, prefetch sends all the queries
+ * at once and installs an asynchronous reply handler that stores the
+ * replies as they arrive. One round trip in prefetchwait collects
+ * them all. Until the window is dropped, getwindowattributes and
+ * the property functions in lib.c are served from the stored replies.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlibint.h>
+
+#include "list.h"
+#include "wind.h"
+
+#ifndef X_DPY_GET_REQUEST
+#define X_DPY_GET_REQUEST(d) ((d)->request)
+#define X_DPY_GET_LAST_REQUEST_READ(d) ((d)->last_request_read)
+#endif
+
+// Length in 32-bit units of the properties fetched
+#define PREFETCHLEN 256
+
+// Index of each query among those sent for a window
+enum { ATTRIBUTES, GEOMETRY, PROPERTIES };
+
+struct reply {
+	Bool ok;	// reply received
+	union {
+		xGetWindowAttributesReply attr;
+		xGetGeometryReply geom;
+		xGetPropertyReply prop;
+	} u;
+	Atom atom;
+	unsigned char *data;	// property value, as sent
+	Bool stale;		// property changed by us since fetched
+};
+
+struct prefetch {
+	Window window;
+	List node;		// in the pending list, while waiting
+	_XAsyncHandler async;
+	uint64_t first;		// sequence number of the first query sent
+	int base;		// index of the first query sent
+	int n;			// number of queries
+	struct reply *replies;
+};
+
+static void sendqueries(Window, const Atom *, int, Bool);
+static Bool handler(Display *, xReply *, char *, int, XPointer);
+static void getpropreply(Display *, struct reply *, xReply *, char *, int);
+static struct reply *findreply(Window, int);
+static struct reply *findpropreply(Window, Atom);
+
+// Prefetched windows
+static struct hashtab prefetched;
+
+// Prefetched windows whose replies are still outstanding
+static LIST_DEFINE(pending);
+
+/*
+ * Stores the replies to the queries sent for a window. Errors are
+ * swallowed, since they most likely mean that the window has gone
+ * away, which the caller finds out by itself.
+ */
+static Bool handler(Display *d, xReply *rep, char *buf, int len,
+		XPointer data)
+{
+	struct prefetch *p = (struct prefetch *)data;
+	uint64_t seq = X_DPY_GET_LAST_REQUEST_READ(d);
+	if (seq < p->first || seq >= p->first + (p->n - p->base))
+		return False;
+
+	int i = p->base + (seq - p->first);
+	struct reply *r = &p->replies[i];
+	if (rep->generic.type == X_Error)
+		return True;
+
+	switch (i) {
+	case ATTRIBUTES:
+		_XGetAsyncReply(d, (char *)&r->u.attr, rep, buf, len,
+				(SIZEOF(xGetWindowAttributesReply) -
+				SIZEOF(xReply)) >> 2, True);
+		break;
+	case GEOMETRY:
+		_XGetAsyncReply(d, (char *)&r->u.geom, rep, buf, len,
+				(SIZEOF(xGetGeometryReply) -
+				SIZEOF(xReply)) >> 2, True);
+		break;
+	default:
+		getpropreply(d, r, rep, buf, len);
+		break;
+	}
+	r->ok = True;
+	return True;
+}
+
+static void getpropreply(Display *d, struct reply *r, xReply *rep,
+		char *buf, int len)
+{
+	xGetPropertyReply *pr = (xGetPropertyReply *)_XGetAsyncReply(d,
+			(char *)&r->u.prop, rep, buf, len,
+			(SIZEOF(xGetPropertyReply) - SIZEOF(xReply)) >> 2,
+			False);
+	long nbytes = 0;
+	if (pr->propertyType != None && (pr->format == 8 ||
+			pr->format == 16 || pr->format == 32))
+		nbytes = pr->nItems * (pr->format / 8);
+	nbytes = MIN(nbytes, (long)pr->length << 2);
+	if (nbytes > 0)
+		r->data = xmalloc(nbytes);
+	_XGetAsyncData(d, (char *)r->data, buf, len,
+			SIZEOF(xGetPropertyReply), nbytes, pr->length << 2);
+}
+
+/*
+ * Sends the queries for the attributes and geometry of a window,
+ * and for the given properties. The replies are not waited for.
+ */
+void prefetch(Window w, const Atom *atoms, int natoms)
+{
+	sendqueries(w, atoms, natoms, True);
+}
+
+/*
+ * Like prefetch, but only for the properties.
+ */
+void prefetchprops(Window w, const Atom *atoms, int natoms)
+{
+	sendqueries(w, atoms, natoms, False);
+}
+
+static void sendqueries(Window w, const Atom *atoms, int natoms,
+		Bool attributes)
+{
+	prefetchdrop(w);
+
+	struct prefetch *p = xmalloc(sizeof *p);
+	p->window = w;
+	p->base = attributes ? ATTRIBUTES : PROPERTIES;
+	p->n = PROPERTIES + natoms;
+	p->replies = xmalloc(p->n * sizeof p->replies[0]);
+	for (int i = 0; i < p->n; i++) {
+		struct reply *r = &p->replies[i];
+		r->ok = False;
+		r->atom = i < PROPERTIES ? None : atoms[i - PROPERTIES];
+		r->data = NULL;
+		r->stale = False;
+	}
+	htinsert(&prefetched, w, p);
+	LIST_INSERT_TAIL(&pending, &p->node);
+
+	LockDisplay(dpy);
+
+	p->first = X_DPY_GET_REQUEST(dpy) + 1;
+	if (attributes) {
+		xResourceReq *rr;
+		GetResReq(GetWindowAttributes, w, rr);
+		GetResReq(GetGeometry, w, rr);
+	}
+
+	for (int i = 0; i < natoms; i++) {
+		xGetPropertyReq *pr;
+		GetReq(GetProperty, pr);
+		pr->window = w;
+		pr->property = atoms[i];
+		pr->type = AnyPropertyType;
+		pr->delete = False;
+		pr->longOffset = 0;
+		pr->longLength = PREFETCHLEN;
+	}
+
+	p->async.next = dpy->async_handlers;
+	p->async.handler = handler;
+	p->async.data = (XPointer)p;
+	dpy->async_handlers = &p->async;
+
+	UnlockDisplay(dpy);
+	SyncHandle();
+}
+
+/*
+ * Waits for the replies to all queries sent by prefetch. This takes
+ * one round trip no matter how many windows were prefetched.
+ */
+void prefetchwait(void)
+{
+	if (LIST_EMPTY(&pending))
+		return;
+
+	XSync(dpy, False);
+
+	LockDisplay(dpy);
+	while (!LIST_EMPTY(&pending)) {
+		List *lp = LIST_HEAD(&pending);
+		struct prefetch *p = LIST_ITEM(lp, struct prefetch, node);
+		DeqAsyncHandler(dpy, &p->async);
+		LIST_REMOVE(lp);
+	}
+	UnlockDisplay(dpy);
+}
+
+/*
+ * Forgets the replies for a window. Later calls query the server.
+ */
+void prefetchdrop(Window w)
+{
+	struct prefetch *p = htfind(&prefetched, w);
+	if (p == NULL)
+		return;
+	if (LIST_MEMBER(&p->node))
+		prefetchwait();
+	htremove(&prefetched, w);
+	for (int i = 0; i < p->n; i++)
+		free(p->replies[i].data);
+	free(p->replies);
+	free(p);
+}
+
+/*
+ * Forgets a prefetched property that is about to be changed.
+ */
+void prefetchforget(Window w, Atom prop)
+{
+	struct reply *r = findpropreply(w, prop);
+	if (r != NULL)
+		r->stale = True;
+}
+
+static struct reply *findreply(Window w, int i)
+{
+	struct prefetch *p = htfind(&prefetched, w);
+	if (p == NULL || LIST_MEMBER(&p->node))
+		return NULL;
+	struct reply *r = &p->replies[i];
+	return r->ok ? r : NULL;
+}
+
+static struct reply *findpropreply(Window w, Atom prop)
+{
+	struct prefetch *p = htfind(&prefetched, w);
+	if (p == NULL)
+		return NULL;
+	for (int i = PROPERTIES; i < p->n; i++)
+		if (p->replies[i].atom == prop)
+			return &p->replies[i];
+	return NULL;
+}
+
+/*
+ * Stores the prefetched attributes of a window, as returned by
+ * XGetWindowAttributes. Returns False if they are not available.
+ */
+Bool getprefetchedattributes(Window w, XWindowAttributes *a)
+{
+	struct reply *ar = findreply(w, ATTRIBUTES);
+	struct reply *gr = findreply(w, GEOMETRY);
+	if (ar == NULL || gr == NULL)
+		return False;
+
+	xGetWindowAttributesReply *attr = &ar->u.attr;
+	a->class = attr->class;
+	a->bit_gravity = attr->bitGravity;
+	a->win_gravity = attr->winGravity;
+	a->backing_store = attr->backingStore;
+	a->backing_planes = attr->backingBitPlanes;
+	a->backing_pixel = attr->backingPixel;
+	a->save_under = attr->saveUnder;
+	a->colormap = attr->colormap;
+	a->map_installed = attr->mapInstalled;
+	a->map_state = attr->mapState;
+	a->all_event_masks = attr->allEventMasks;
+	a->your_event_mask = attr->yourEventMask;
+	a->do_not_propagate_mask = attr->doNotPropagateMask;
+	a->override_redirect = attr->override;
+	LockDisplay(dpy);
+	a->visual = _XVIDtoVisual(dpy, attr->visualID);
+	UnlockDisplay(dpy);
+
+	xGetGeometryReply *geom = &gr->u.geom;
+	a->x = geom->x;
+	a->y = geom->y;
+	a->width = geom->width;
+	a->height = geom->height;
+	a->border_width = geom->borderWidth;
+	a->depth = geom->depth;
+	a->root = geom->root;
+	a->screen = NULL;
+	for (int i = 0; i < ScreenCount(dpy); i++)
+		if (RootWindow(dpy, i) == a->root)
+			a->screen = ScreenOfDisplay(dpy, i);
+	return True;
+}
+
+/*
+ * Like XGetWindowProperty with an offset of zero, but served from
+ * a prefetched reply. Returns False if the property was not
+ * prefetched in full, in which case the server must be asked.
+ */
+Bool getprefetchedprop(Window w, Atom prop, Atom type, Atom *rtype,
+		int *rfmt, unsigned long *rcount, unsigned long *rafter,
+		unsigned char **rdata)
+{
+	struct reply *r = findpropreply(w, prop);
+	if (r == NULL || !r->ok || r->stale || r->u.prop.bytesAfter != 0)
+		return False;
+
+	xGetPropertyReply *pr = &r->u.prop;
+	*rtype = pr->propertyType;
+	*rfmt = pr->format;
+	*rcount = 0;
+	*rafter = 0;
+	*rdata = NULL;
+	if (pr->propertyType == None)
+		return True;
+	if (type != AnyPropertyType && type != pr->propertyType) {
+		// The server returns no data for another type.
+		*rafter = pr->nItems * (pr->format / 8);
+		return True;
+	}
+
+	// Convert the data the way XGetWindowProperty does.
+	unsigned long n = pr->nItems;
+	unsigned char *v;
+	switch (pr->format) {
+	case 8:
+		v = Xmalloc(n + 1);
+		memcpy(v, r->data, n);
+		v[n] = '\0';
+		break;
+	case 16:
+		v = Xmalloc(n * sizeof (short) + 1);
+		for (unsigned long i = 0; i < n; i++)
+			((short *)v)[i] = ((INT16 *)r->data)[i];
+		break;
+	case 32:
+		v = Xmalloc(n * sizeof (long) + 1);
+		for (unsigned long i = 0; i < n; i++)
+			((long *)v)[i] = ((INT32 *)r->data)[i];
+		break;
+	default:
+		return False;
+	}
+	*rcount = n;
+	*rdata = v;
+	return True;
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <X11/Xlib.h>
+#include <X11/Xproto.h>
 
 #include "wind.h"
 
@@ -42,6 +43,7 @@ static Bool pointerhere;
 static const struct listener listener = {
 	.function = event,
 	.pointer = NULL,
+	.name = "root",
 };
 
 static struct keybind {
@@ -98,6 +100,7 @@ static void configurerequest(XConfigureRequestEvent *e)
 	// Ignore stacking requests for now.
 	e->value_mask &= ~(CWSibling | CWStackMode);
 
+	TRACK(X_ConfigureWindow, e->window);
 	XConfigureWindow(dpy, e->window, e->value_mask,
 			&(XWindowChanges){
 				.x = e->x,
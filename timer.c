@@ -0,0 +1,207 @@
+/*
+ * Copyright 2010 Johan Veenhuizen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Timers for deferred work in the event loop.
+ *
+ * Pending timers are kept in a hashed timer wheel: a circular array
+ * of lists, one per tick, where a timer expiring at tick t is found
+ * in slot t modulo the number of slots. Scheduling and cancelling are
+ * constant time. The event loop asks for the time until the next
+ * expiry before it blocks, and runs the expired timers when it wakes.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <X11/Xlib.h>
+
+#include "list.h"
+#include "wind.h"
+
+// Milliseconds per tick
+#define TICK 10
+
+// Number of slots in the wheel; a power of two
+#define NSLOTS 256
+
+struct timer {
+	List node;
+	void (*function)(void *);
+	void *arg;
+	unsigned long tick;	// expiry tick
+};
+
+static unsigned long now(void);
+
+static List wheel[NSLOTS];
+
+// Last tick whose timers have been run
+static unsigned long lasttick;
+
+// Number of pending timers
+static size_t npending;
+
+static Bool initialized = False;
+
+static DEFINE_POOL(timerpool, struct timer);
+
+/*
+ * Returns the current time in ticks.
+ */
+static unsigned long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (1000 / TICK) + ts.tv_nsec / (TICK * 1000000L);
+}
+
+/*
+ * Create a timer that calls function with arg when it expires.
+ * The timer is not scheduled.
+ */
+struct timer *tcreate(void (*function)(void *), void *arg)
+{
+	if (!initialized) {
+		for (int i = 0; i < NSLOTS; i++)
+			LIST_INIT(&wheel[i]);
+		lasttick = now();
+		initialized = True;
+	}
+
+	struct timer *t = palloc(&timerpool);
+	LIST_INIT(&t->node);
+	t->function = function;
+	t->arg = arg;
+	t->tick = 0;
+	return t;
+}
+
+void tdestroy(struct timer *t)
+{
+	tcancel(t);
+	pfree(&timerpool, t);
+}
+
+/*
+ * Schedule the timer to expire after the specified number of
+ * milliseconds, rounded up to whole ticks. A timer that is
+ * already pending is rescheduled.
+ */
+void tschedule(struct timer *t, unsigned long ms)
+{
+	tcancel(t);
+	t->tick = MAX(now() + (ms + TICK - 1) / TICK, lasttick + 1);
+	LIST_INSERT_TAIL(&wheel[t->tick % NSLOTS], &t->node);
+	npending++;
+}
+
+void tcancel(struct timer *t)
+{
+	if (LIST_MEMBER(&t->node)) {
+		LIST_REMOVE(&t->node);
+		npending--;
+	}
+}
+
+Bool tispending(struct timer *t)
+{
+	return LIST_MEMBER(&t->node);
+}
+
+/*
+ * Get the time until the next timer expires. Returns False,
+ * leaving ts untouched, if there are no pending timers.
+ *
+ * Timers more than one turn of the wheel away are not looked
+ * for. Instead, the caller is woken up after one turn.
+ */
+Bool tnexttimeout(struct timespec *ts)
+{
+	if (npending == 0)
+		return False;
+
+	unsigned long t = now();
+	unsigned long next = lasttick + NSLOTS;
+	for (unsigned long tick = lasttick + 1;
+			tick < lasttick + NSLOTS; tick++) {
+		List *lp;
+		LIST_FOREACH(lp, &wheel[tick % NSLOTS])
+			if (LIST_ITEM(lp, struct timer, node)->tick == tick)
+				break;
+		if (lp != &wheel[tick % NSLOTS]) {
+			next = tick;
+			break;
+		}
+	}
+
+	unsigned long ms = next > t ? (next - t) * TICK : 0;
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000L;
+	return True;
+}
+
+/*
+ * Run the timers that have expired.
+ */
+void runtimers(void)
+{
+	if (npending == 0) {
+		if (initialized)
+			lasttick = now();
+		return;
+	}
+
+	unsigned long t = now();
+	if (t <= lasttick)
+		return;
+
+	/*
+	 * Collect the expired timers first, since the callbacks may
+	 * schedule and cancel timers. If more than one turn of the
+	 * wheel has passed, each slot is visited once.
+	 */
+	LIST_DEFINE(expired);
+	unsigned long first = t - lasttick > NSLOTS ? t - NSLOTS + 1 :
+			lasttick + 1;
+	for (unsigned long tick = first; tick <= t; tick++) {
+		List *slot = &wheel[tick % NSLOTS];
+		List *lp = slot->next;
+		while (lp != slot) {
+			List *next = lp->next;
+			if (LIST_ITEM(lp, struct timer, node)->tick <= t) {
+				LIST_REMOVE(lp);
+				LIST_INSERT_TAIL(&expired, lp);
+			}
+			lp = next;
+		}
+	}
+	lasttick = t;
+
+	while (!LIST_EMPTY(&expired)) {
+		struct timer *x = LIST_ITEM(LIST_HEAD(&expired),
+				struct timer, node);
+		LIST_REMOVE(&x->node);
+		npending--;
+		stats.timers++;
+		x->function(x->arg);
+	}
+}
@@ -1,6 +1,7 @@
 #ifndef WIND_H
 #define WIND_H
 
+#include <stdio.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 
@@ -32,6 +33,9 @@ struct extents {
 struct listener {
 	void *pointer;
 	void (*function)(void *, XEvent *);
+
+	// Listener kind, for profiling output
+	const char *name;
 };
 
 struct bitmap {
@@ -49,10 +53,59 @@ struct bitmap {
 			.pixmap = None \
 		}
 
+/*
+ * Hash table mapping XIDs, such as windows and atoms, to pointers.
+ * Zero-initialize before use.
+ */
+struct hashtab {
+	struct hashentry {
+		XID key;
+		void *value;
+	} *v;
+	size_t n;
+	size_t lim;
+};
+
+/*
+ * Pool of fixed-size objects, carved out of slabs and recycled
+ * through a free list. Define with DEFINE_POOL.
+ */
+struct pool {
+	const char *name;
+	size_t size;
+	void *free;		// free list of objects
+	unsigned long live;	// objects allocated and not yet freed
+	unsigned long peak;	// highest number of live objects
+	unsigned long slabs;	// slabs allocated
+	struct pool *next;	// next pool with slabs
+};
+
+#define DEFINE_POOL(var, type) \
+		struct pool var = { \
+			.name = #type, \
+			.size = sizeof (type), \
+			.free = NULL, \
+			.live = 0, \
+			.peak = 0, \
+			.slabs = 0, \
+			.next = NULL \
+		}
+
+/*
+ * An atom to be interned, and the variable that receives it.
+ * Declare tables of them with declareatoms.
+ */
+struct atomdef {
+	Atom *atom;
+	const char *name;
+};
+
 struct button;
 struct client;
 struct dragger;
 struct frame;
+struct timer;
+struct timespec;
 
 struct font {
 	int ascent;
@@ -100,13 +153,88 @@ struct fontcolor *fnormal;
 
 extern struct bitmap *deletebitmap;
 
+/*
+ * Event loop statistics. If debug mode is enabled, these are
+ * printed on standard error at exit and on SIGUSR1.
+ */
+extern struct stats {
+	// Number of event batches, and events dispatched in them
+	unsigned long batches;
+	unsigned long events;
+
+	// Size of the largest batch, and a histogram of batch
+	// sizes in powers of two: 1, 2-3, 4-7, ..., 128 and up.
+	unsigned long maxbatch;
+	unsigned long batchsizes[8];
+
+	// Stacking changes requested, restacks performed, and
+	// windows moved by them
+	unsigned long restackrequests;
+	unsigned long restacks;
+	unsigned long restackmoves;
+
+	// EWMH property changes, and property writes performed
+	unsigned long ewmhupdates;
+	unsigned long ewmhwrites;
+
+	// Stacking order property writes, and those skipped as unchanged
+	unsigned long stackingwritten;
+	unsigned long stackingskipped;
+
+	// Listener lookups, and lookups served by the last-window cache
+	unsigned long lookups;
+	unsigned long lookupcachehits;
+
+	// Motion events skipped in favor of a newer one
+	unsigned long motioncoalesced;
+
+	// Client PropertyNotify events, and properties reloaded
+	unsigned long propevents;
+	unsigned long propreloads;
+
+	// ConfigureRequest events merged into an earlier one
+	unsigned long confcoalesced;
+
+	// Timers run
+	unsigned long timers;
+
+	// X errors received, and those caused by a tracked request
+	unsigned long xerrors;
+	unsigned long xerrorstracked;
+
+	// Client stack snapshots taken, and stack buffer allocations
+	unsigned long stacksnapshots;
+	unsigned long stackallocs;
+
+	// Top-level windows found at startup, and those adopted
+	unsigned long startupwindows;
+	unsigned long startupadopted;
+
+	// Microseconds spent at startup querying the windows,
+	// managing them, and restacking and mapping them
+	unsigned long startupquery;
+	unsigned long startupmanage;
+	unsigned long startuprestack;
+} stats;
+
 extern Atom WM_CHANGE_STATE;
 extern Atom WM_DELETE_WINDOW;
 extern Atom WM_PROTOCOLS;
 extern Atom WM_STATE;
 
 void errorf(const char *, ...);
+void trackrequest(int, XID, const char *, int);
+
+/*
+ * Track the next request, so that an X error caused by it can be
+ * reported along with the call site. Use it before requests that
+ * may fail because a client window went away. The opcode is that
+ * of the request, as in <X11/Xproto.h>.
+ */
+#define TRACK(opcode, resource) \
+	trackrequest((opcode), (resource), __FILE__, __LINE__)
 void setlistener(Window, const struct listener *);
+struct listener *getlistener(Window);
 int redirect(XEvent *, Window);
 
 struct fontcolor *ftloadcolor(const char *);
@@ -129,8 +257,14 @@ Window fgetwin(struct frame *);
 struct geometry fgetgeom(struct frame *);
 struct extents estimateframeextents(Window);
 
+void initclient(void);
+void addprophandler(Atom, void (*)(struct client *));
+void addprefetch(Atom);
+void cownprop(struct client *, Atom);
+void addmsghandler(Atom, void (*)(struct client *, XClientMessageEvent *));
 struct client *manage(Window);
 void manageall(void);
+void updateclients(void);
 void unmanageall(void);
 void cpopapp(struct client *);
 void cpushapp(struct client *);
@@ -139,6 +273,8 @@ void csetdesk(struct client *, Desk);
 void csetappdesk(struct client *, Desk);
 Desk cgetdesk(struct client *);
 void csetdock(struct client *, Bool);
+void csetabove(struct client *, Bool);
+void csetbelow(struct client *, Bool);
 void csetfull(struct client *, Bool);
 void csetundecorated(struct client *, Bool);
 void csetappfollowdesk(struct client *, Bool);
@@ -176,42 +312,78 @@ struct dragger *dcreate(Window, int, int, int, int, int, Cursor,
 		void (*)(void *, int, int, unsigned long, Time), void *);
 void ddestroy(struct dragger *);
 
+struct timer *tcreate(void (*)(void *), void *);
+void tdestroy(struct timer *);
+void tschedule(struct timer *, unsigned long);
+void tcancel(struct timer *);
+Bool tispending(struct timer *);
+Bool tnexttimeout(struct timespec *);
+void runtimers(void);
+
+void prefetch(Window, const Atom *, int);
+void prefetchprops(Window, const Atom *, int);
+void prefetchwait(void);
+void prefetchdrop(Window);
+void prefetchforget(Window, Atom);
+Bool getprefetchedattributes(Window, XWindowAttributes *);
+Bool getprefetchedprop(Window, Atom, Atom, Atom *, int *, unsigned long *,
+		unsigned long *, unsigned char **);
+
 void ewmh_notifyndesk(unsigned long);
 void ewmh_notifycurdesk(unsigned long);
 void ewmh_notifyclientdesktop(Window, unsigned long);
 void ewmh_notifyframeextents(Window, struct extents);
+void ewmh_declareatoms(void);
 void ewmh_startwm(void);
 void ewmh_stopwm(void);
 void ewmh_maprequest(struct client *);
-void ewmh_notifyfull(Window, Bool);
+void ewmh_notifyfull(struct client *, Bool);
 void ewmh_manage(struct client *);
 void ewmh_unmanage(struct client *);
 void ewmh_withdraw(struct client *);
 void ewmh_notifyfocus(Window, Window);
 void ewmh_notifyrestack(void);
-void ewmh_propertynotify(struct client *, XPropertyEvent *);
-void ewmh_clientmessage(struct client *, XClientMessageEvent *);
+void ewmh_flush(void);
 void ewmh_rootclientmessage(XClientMessageEvent *);
 
+void mwm_declareatoms(void);
 void mwm_startwm(void);
 void mwm_manage(struct client *);
-void mwm_propertynotify(struct client *, XPropertyEvent *);
 
 void *xmalloc(size_t);
 void *xrealloc(const void *, size_t);
 char *xstrdup(const char *);
+unsigned long usecs(void);
+void *palloc(struct pool *);
+void pfree(struct pool *, void *);
+void printpools(FILE *);
+void declareatoms(const struct atomdef *, int);
+void internatoms(void);
+int atomindex(Atom, const struct atomdef *, int);
+void *htfind(struct hashtab *, XID);
+void htinsert(struct hashtab *, XID, void *);
+void htremove(struct hashtab *, XID);
 void grabkey(int, unsigned, Window, Bool, int, int);
 void ungrabkey(int, unsigned, Window);
 void grabbutton(unsigned, unsigned, Window, Bool, unsigned, int, int,
 		Window, Cursor);
 void ungrabbutton(unsigned, unsigned, Window);
+Bool getwindowattributes(Window, XWindowAttributes *);
 long getwmstate(Window);
 void setwmstate(Window, long);
 Bool ismapped(Window);
+XWMHints *getwmhints(Window);
+Bool getwmnormalhints(Window, XSizeHints *);
+char *getwmname(Window);
+Atom *getwmprotocols(Window, int *);
+Window gettransientfor(Window);
 char *decodetextproperty(XTextProperty *);
 void setprop(Window, Atom, Atom, int, void *, int);
+void appendprop(Window, Atom, Atom, int, void *, int);
 void *getprop(Window, Atom, Atom, int, unsigned long *);
 void drawbitmap(Drawable, GC, struct bitmap *, int, int);
 unsigned long getpixel(const char *);
+void compressmotion(XMotionEvent *);
+void compressconfrequest(XConfigureRequestEvent *);
 
 #endif